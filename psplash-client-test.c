@@ -0,0 +1,208 @@
+/*
+ * psplash-client-test - checks the ordering guarantees of the client library
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "psplash.h"
+#include "psplash-shm.h"
+#include "psplash-client.h"
+
+static int failed;
+
+static void
+check (int cond, const char *what)
+{
+  if (!cond)
+    {
+      fprintf (stderr, "FAIL: %s\n", what);
+      failed = 1;
+    }
+}
+
+/* Reads what the client wrote to the FIFO so far */
+static const char *
+fifo_drain (int fd)
+{
+  static char buf[PSPLASH_CMD_MAX];
+  ssize_t     len;
+
+  len = read (fd, buf, sizeof(buf) - 1);
+  buf[len > 0 ? len : 0] = '\0';
+
+  return buf;
+}
+
+/* How often a file is mapped into this process */
+static int
+maps_count (const char *path)
+{
+  FILE *maps = fopen ("/proc/self/maps", "r");
+  char  line[PATH_MAX + 128];
+  int   n = 0;
+
+  if (!maps)
+    return -1;
+
+  while (fgets (line, sizeof(line), maps))
+    if (strstr (line, path))
+      n++;
+
+  fclose (maps);
+  return n;
+}
+
+/* Commands queued before a progress or message update through shared
+ * memory have to reach psplash first, or the update is overwritten by the
+ * older commands once they are flushed */
+static void
+test_queue_before_shm (const char *dir, int fifo_fd, PSplashShm *shm,
+		       const char *segment)
+{
+  PSplashClient *client;
+  int            mapped = maps_count (segment);
+
+  client = psplash_client_open (dir);
+  check (client != NULL, "open");
+  if (!client)
+    return;
+
+  check (maps_count (segment) == mapped, "shared memory mapped lazily");
+
+  check (psplash_client_send (client, "MSG Starting udev") == 0, "send MSG");
+  check (psplash_client_send (client, "PROGRESS 10") == 0, "send PROGRESS");
+  check (psplash_client_progress (client, 90) == 0, "progress");
+
+  check (!strcmp (fifo_drain (fifo_fd), "MSG Starting udev\nPROGRESS 10\n"),
+	 "queued commands flushed before the shared memory progress");
+  check (shm->progress == 90, "progress in shared memory");
+  check (maps_count (segment) == mapped + 1, "shared memory mapped on use");
+
+  check (psplash_client_msg (client, "Boot done") == 0, "msg");
+  check (psplash_client_close (client) == 0, "close");
+
+  check (!strcmp (shm->msg, "Boot done"), "message in shared memory");
+  check (!strcmp (fifo_drain (fifo_fd), ""), "nothing left queued");
+}
+
+/* Waiting sends an ACK and reads the reply to it, which the FIFO can't */
+static void
+test_wait (const char *dir, const char *socket_path)
+{
+  struct sockaddr_un addr;
+  PSplashClient     *client;
+  char               buf[PSPLASH_CMD_MAX];
+  int                listen_fd, fd;
+
+  client = psplash_client_open (dir);
+  check (client != NULL, "open FIFO");
+  if (client)
+    {
+      check (psplash_client_wait (client) < 0 && errno == ENOTSUP,
+	     "no waiting on the FIFO");
+      psplash_client_close (client);
+    }
+
+  /* Play psplash's end of the control socket */
+  memset (&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  memcpy (addr.sun_path, socket_path,
+	  MIN (strlen (socket_path) + 1, sizeof(addr.sun_path) - 1));
+
+  listen_fd = socket (AF_UNIX, SOCK_SEQPACKET, 0);
+  if (listen_fd < 0
+      || bind (listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+      || listen (listen_fd, 1) < 0)
+    {
+      perror ("Error creating " PSPLASH_SOCKET);
+      failed = 1;
+      return;
+    }
+
+  client = psplash_client_open (dir);
+  fd = accept (listen_fd, NULL, NULL);
+  check (client != NULL && fd >= 0, "open socket");
+  if (!client || fd < 0)
+    goto out;
+
+  check (psplash_client_send (client, "MSG Starting udev") == 0, "send MSG");
+  check (psplash_client_flush (client) == 0, "flush");
+
+  /* Answer ahead of time, the client reads it once it waits */
+  send (fd, "OK 1.000000000", 15, 0);
+  check (psplash_client_wait (client) == 0, "wait");
+
+  check (recv (fd, buf, sizeof(buf), MSG_DONTWAIT) == 18
+	 && !memcmp (buf, "MSG Starting udev\n", 18), "command before ACK");
+  check (recv (fd, buf, sizeof(buf), MSG_DONTWAIT) == 4
+	 && !memcmp (buf, "ACK\n", 4), "ACK sent on wait");
+
+  /* Now every message is answered, the ACK of this wait as well */
+  check (psplash_client_send (client, "PROGRESS 50") == 0, "send PROGRESS");
+  check (psplash_client_flush (client) == 0, "flush");
+  send (fd, "OK 2.000000000", 15, 0);
+  check (psplash_client_wait (client) < 0 && errno == ETIMEDOUT,
+	 "wait for every reply");
+
+ out:
+  if (client)
+    psplash_client_close (client);
+  if (fd >= 0)
+    close (fd);
+  close (listen_fd);
+  unlink (socket_path);
+}
+
+int
+main (void)
+{
+  char        dir[] = "/tmp/psplash-client-test.XXXXXX";
+  char        fifo[PATH_MAX], segment[PATH_MAX], socket_path[PATH_MAX];
+  PSplashShm *shm;
+  int         fifo_fd, shm_fd;
+
+  if (!mkdtemp (dir))
+    {
+      perror ("mkdtemp");
+      return 1;
+    }
+
+  snprintf (fifo, sizeof(fifo), "%s/%s", dir, PSPLASH_FIFO);
+  snprintf (segment, sizeof(segment), "%s/%s", dir, PSPLASH_SHM);
+  snprintf (socket_path, sizeof(socket_path), "%s/%s", dir, PSPLASH_SOCKET);
+
+  if (mkfifo (fifo, S_IRUSR | S_IWUSR) < 0
+      || (fifo_fd = open (fifo, O_RDONLY | O_NONBLOCK)) < 0)
+    {
+      perror ("Error creating " PSPLASH_FIFO);
+      return 1;
+    }
+
+  /* Play psplash's end of the shared memory channel */
+  shm_fd = open (segment, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+  if (shm_fd < 0 || ftruncate (shm_fd, sizeof(PSplashShm)) < 0)
+    {
+      perror ("Error creating " PSPLASH_SHM);
+      return 1;
+    }
+  shm = mmap (NULL, sizeof(PSplashShm), PROT_READ | PROT_WRITE, MAP_SHARED,
+	      shm_fd, 0);
+  close (shm_fd);
+  if (shm == MAP_FAILED)
+    {
+      perror ("Error mapping " PSPLASH_SHM);
+      return 1;
+    }
+  shm->magic = PSPLASH_SHM_MAGIC;
+
+  test_queue_before_shm (dir, fifo_fd, shm, segment);
+  test_wait (dir, socket_path);
+
+  munmap (shm, sizeof(PSplashShm));
+  close (fifo_fd);
+  unlink (segment);
+  unlink (fifo);
+  rmdir (dir);
+
+  return failed;
+}
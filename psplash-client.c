@@ -0,0 +1,398 @@
+/*
+ * psplash-client - library for sending commands to psplash
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <linux/futex.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include "psplash.h"
+#include "psplash-shm.h"
+#include "psplash-client.h"
+
+/* How long a flush waits for psplash to make room in a full queue, and a
+ * wait for each reply */
+#define PSPLASH_CLIENT_TIMEOUT_MS 1000
+
+struct PSplashClient
+{
+  int         fd;
+  int         is_socket;
+  PSplashShm *shm;
+  char       *shm_path;
+
+  /* Set once an ACK went out, after which psplash answers every message.
+   * unacked counts the replies not read yet. */
+  int         acking;
+  unsigned    unacked;
+
+  /* Queued commands, newline separated. Kept below PIPE_BUF so a batch
+   * written to the FIFO never interleaves with another writer's. */
+  size_t      len;
+  char        buf[PSPLASH_CMD_MAX - 1];
+};
+
+static PSplashShm *
+psplash_shm_open (const char *path)
+{
+  PSplashShm *shm;
+  int         fd;
+
+  if ((fd = open (path, O_RDWR | O_CLOEXEC)) < 0)
+    return NULL;
+
+  shm = mmap (NULL, sizeof(PSplashShm), PROT_READ | PROT_WRITE,
+	      MAP_SHARED, fd, 0);
+  close (fd);
+
+  if (shm == MAP_FAILED)
+    return NULL;
+
+  if (__atomic_load_n (&shm->magic, __ATOMIC_ACQUIRE) != PSPLASH_SHM_MAGIC)
+    {
+      munmap (shm, sizeof(PSplashShm));
+      return NULL;
+    }
+
+  return shm;
+}
+
+/* Takes the seqlock of the segment, making seq odd */
+static int
+psplash_shm_lock (PSplashShm *shm)
+{
+  uint32_t seq;
+  int      tries;
+
+  if (__atomic_load_n (&shm->magic, __ATOMIC_ACQUIRE) != PSPLASH_SHM_MAGIC)
+    return -1;
+
+  for (tries = 0; tries < PSPLASH_SHM_RETRIES; tries++)
+    {
+      seq = __atomic_load_n (&shm->seq, __ATOMIC_RELAXED);
+      if (!(seq & 1)
+	  && __atomic_compare_exchange_n (&shm->seq, &seq, seq + 1, 0,
+					  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	return 0;
+
+      /* Let the writer holding it finish */
+      sched_yield ();
+    }
+
+  return -1;
+}
+
+/* Releases the seqlock and wakes psplash unless a wakeup is still pending */
+static void
+psplash_shm_unlock (PSplashShm *shm)
+{
+  __atomic_add_fetch (&shm->seq, 1, __ATOMIC_RELEASE);
+
+  if (__atomic_exchange_n (&shm->pending, 1, __ATOMIC_SEQ_CST))
+    return;
+
+  __atomic_add_fetch (&shm->wake, 1, __ATOMIC_RELEASE);
+  syscall (SYS_futex, &shm->wake, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+static int
+psplash_shm_progress (PSplashShm *shm, int value)
+{
+  if (psplash_shm_lock (shm))
+    return -1;
+
+  shm->progress = value;
+  shm->progress_seq++;
+
+  psplash_shm_unlock (shm);
+  return 0;
+}
+
+static int
+psplash_shm_msg (PSplashShm *shm, const char *msg)
+{
+  if (psplash_shm_lock (shm))
+    return -1;
+
+  snprintf (shm->msg, sizeof(shm->msg), "%s", msg);
+  shm->msg_seq++;
+
+  psplash_shm_unlock (shm);
+  return 0;
+}
+
+static int
+psplash_client_connect (const char *path)
+{
+  struct sockaddr_un addr;
+  struct timeval     timeout = { PSPLASH_CLIENT_TIMEOUT_MS / 1000,
+				 PSPLASH_CLIENT_TIMEOUT_MS % 1000 * 1000 };
+  size_t             len = strlen (path);
+  int                fd;
+
+  if (len >= sizeof(addr.sun_path))
+    return -1;
+
+  if ((fd = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0)
+    return -1;
+
+  memset (&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  memcpy (addr.sun_path, path, len + 1);
+
+  /* Wait, for a while, for psplash to accept rather than falling back to
+   * the FIFO, which would let our commands overtake those still queued on
+   * the socket */
+  setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  if (connect (fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+      || fcntl (fd, F_SETFL, O_NONBLOCK) < 0)
+    {
+      close (fd);
+      return -1;
+    }
+
+  return fd;
+}
+
+PSplashClient *
+psplash_client_open (const char *rundir)
+{
+  PSplashClient *client;
+  char           path[PATH_MAX];
+
+  if (!rundir)
+    rundir = getenv ("PSPLASH_FIFO_DIR");
+
+  if (!rundir)
+    rundir = "/run";
+
+  if ((client = calloc (1, sizeof(PSplashClient))) == NULL)
+    return NULL;
+
+  snprintf (path, sizeof(path), "%s/%s", rundir, PSPLASH_SOCKET);
+  if ((client->fd = psplash_client_connect (path)) >= 0)
+    {
+      client->is_socket = 1;
+    }
+  else
+    {
+      snprintf (path, sizeof(path), "%s/%s", rundir, PSPLASH_FIFO);
+      client->fd = open (path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    }
+
+  if (client->fd < 0)
+    {
+      free (client);
+      return NULL;
+    }
+
+  /* Mapped on first use, most clients never update through it */
+  snprintf (path, sizeof(path), "%s/%s", rundir, PSPLASH_SHM);
+  client->shm_path = strdup (path);
+
+  return client;
+}
+
+static PSplashShm *
+psplash_client_shm (PSplashClient *client)
+{
+  if (client->shm_path)
+    {
+      client->shm = psplash_shm_open (client->shm_path);
+      free (client->shm_path);
+      client->shm_path = NULL;
+    }
+
+  return client->shm;
+}
+
+/* Writes one message, waiting for psplash when its queue is full */
+static int
+psplash_client_write (PSplashClient *client, const char *buf, size_t len)
+{
+  struct pollfd pfd = { .fd = client->fd, .events = POLLOUT };
+  ssize_t       ret;
+
+  while (1)
+    {
+      if (client->is_socket)
+	ret = send (client->fd, buf, len, MSG_NOSIGNAL);
+      else
+	ret = write (client->fd, buf, len);
+
+      if (ret >= 0)
+	{
+	  /* Writes up to PIPE_BUF are all or nothing */
+	  if ((size_t)ret == len)
+	    return 0;
+	  errno = EIO;
+	  return -1;
+	}
+
+      if (errno == EINTR)
+	continue;
+      if (errno != EAGAIN)
+	return -1;
+
+      ret = poll (&pfd, 1, PSPLASH_CLIENT_TIMEOUT_MS);
+      if (ret == 0)
+	{
+	  errno = ETIMEDOUT;
+	  return -1;
+	}
+      if (ret < 0 && errno != EINTR)
+	return -1;
+    }
+}
+
+int
+psplash_client_flush (PSplashClient *client)
+{
+  int ret;
+
+  if (!client->len)
+    return 0;
+
+  ret = psplash_client_write (client, client->buf, client->len);
+  client->len = 0;
+
+  if (ret == 0 && client->acking)
+    client->unacked++;
+
+  return ret;
+}
+
+int
+psplash_client_send (PSplashClient *client, const char *command)
+{
+  size_t len = strlen (command);
+
+  if (len + 1 > sizeof(client->buf))
+    {
+      errno = EMSGSIZE;
+      return -1;
+    }
+
+  if (client->len + len + 1 > sizeof(client->buf)
+      && psplash_client_flush (client))
+    return -1;
+
+  memcpy (client->buf + client->len, command, len);
+  client->len += len;
+  client->buf[client->len++] = '\n';
+
+  if (client->is_socket && !strcmp (command, "ACK"))
+    client->acking = 1;
+
+  return 0;
+}
+
+int
+psplash_client_wait (PSplashClient *client)
+{
+  struct pollfd pfd = { .fd = client->fd, .events = POLLIN };
+  char          reply[32];
+  ssize_t       ret;
+
+  /* Only the control socket answers */
+  if (!client->is_socket)
+    {
+      errno = ENOTSUP;
+      return -1;
+    }
+
+  /* The message holding the ACK is answered once everything sent before
+   * it is on screen */
+  if (psplash_client_send (client, "ACK") || psplash_client_flush (client))
+    return -1;
+
+  while (client->unacked)
+    {
+      ret = recv (client->fd, reply, sizeof(reply), 0);
+      if (ret > 0)
+	{
+	  client->unacked--;
+	  continue;
+	}
+
+      if (ret == 0)
+	{
+	  errno = EPIPE;
+	  return -1;
+	}
+      if (errno == EINTR)
+	continue;
+      if (errno != EAGAIN)
+	return -1;
+
+      ret = poll (&pfd, 1, PSPLASH_CLIENT_TIMEOUT_MS);
+      if (ret == 0)
+	{
+	  errno = ETIMEDOUT;
+	  return -1;
+	}
+      if (ret < 0 && errno != EINTR)
+	return -1;
+    }
+
+  return 0;
+}
+
+int
+psplash_client_progress (PSplashClient *client, int value)
+{
+  char command[32];
+
+  if (psplash_client_shm (client))
+    {
+      /* The queued commands go first, the update would overtake them */
+      if (psplash_client_flush (client))
+	return -1;
+      if (psplash_shm_progress (client->shm, value) == 0)
+	return 0;
+    }
+
+  snprintf (command, sizeof(command), "PROGRESS %d", value);
+  return psplash_client_send (client, command);
+}
+
+int
+psplash_client_msg (PSplashClient *client, const char *msg)
+{
+  char command[PSPLASH_CMD_MAX];
+
+  /* Messages too long for the segment go out as a command */
+  if (strlen (msg) < PSPLASH_SHM_MSG_MAX && psplash_client_shm (client))
+    {
+      if (psplash_client_flush (client))
+	return -1;
+      if (psplash_shm_msg (client->shm, msg) == 0)
+	return 0;
+    }
+
+  if (snprintf (command, sizeof(command), "MSG %s", msg)
+      >= (int)sizeof(command))
+    {
+      errno = EMSGSIZE;
+      return -1;
+    }
+
+  return psplash_client_send (client, command);
+}
+
+int
+psplash_client_close (PSplashClient *client)
+{
+  int ret = psplash_client_flush (client);
+
+  if (client->shm)
+    munmap (client->shm, sizeof(PSplashShm));
+  free (client->shm_path);
+  close (client->fd);
+  free (client);
+
+  return ret;
+}
@@ -0,0 +1,48 @@
+/*
+ * psplash-client - library for sending commands to psplash
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#ifndef _HAVE_PSPLASH_CLIENT_H
+#define _HAVE_PSPLASH_CLIENT_H
+
+typedef struct PSplashClient PSplashClient;
+
+/* Connects to the psplash running in rundir, or in $PSPLASH_FIFO_DIR or /run
+ * when rundir is NULL. The control socket is used when psplash has one and
+ * the FIFO otherwise. Returns NULL if psplash is not running. */
+PSplashClient *
+psplash_client_open (const char *rundir);
+
+/* Queues a command such as "MSG Booting". Queued commands are sent together
+ * by psplash_client_flush() or once no more fit in one message. */
+int
+psplash_client_send (PSplashClient *client, const char *command);
+
+/* Sets the progress, through shared memory without a system call where
+ * psplash offers it and as a queued PROGRESS command otherwise */
+int
+psplash_client_progress (PSplashClient *client, int value);
+
+/* Sets the message the same way, messages that do not fit the shared
+ * memory segment are queued as a MSG command */
+int
+psplash_client_msg (PSplashClient *client, const char *msg);
+
+/* Sends the queued commands, waiting a while for psplash to drain its queue
+ * when it is full. Returns 0 on success and -1 with errno set otherwise. */
+int
+psplash_client_flush (PSplashClient *client);
+
+/* Flushes and waits until psplash shows everything sent so far, which only
+ * the control socket reports. Returns -1 with errno set to ENOTSUP on the
+ * FIFO and to ETIMEDOUT when psplash does not answer in time. */
+int
+psplash_client_wait (PSplashClient *client);
+
+/* Flushes and disconnects */
+int
+psplash_client_close (PSplashClient *client);
+
+#endif
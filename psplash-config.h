@@ -26,6 +26,18 @@
 #define PSPLASH_SHOW_PROGRESS_BAR 1
 #endif
 
+/* Lines of message text shown when the message and progress bar are put
+ * on a plane of their own, longer messages are cut off */
+#ifndef PSPLASH_LAYER_MSG_LINES
+#define PSPLASH_LAYER_MSG_LINES 2
+#endif
+
+/* Preferred DRM buffer depth, 16 halves the memory traffic of drawing and
+ * scanout if the display supports RGB565, 32 otherwise */
+#ifndef PSPLASH_DRM_BPP
+#define PSPLASH_DRM_BPP 32
+#endif
+
 /* Position of the image split from top edge, numerator of fraction */
 #define PSPLASH_IMG_SPLIT_NUMERATOR 5
 
@@ -9,17 +9,22 @@
 
 #include "psplash.h"
 
-/* Globals, needed for signal handling */
+/* Globals, needed for VT switch handling */
 static int ConsoleFd      = -1;
 static int VTNum          = -1;
 static int VTNumInitial   = -1;
 static int Visible        =  1;
 
-static void
-vt_request (int UNUSED(sig))
+/* Called from the main loop when the kernel asks us, through SIGUSR1, to
+ * release or reacquire the VT */
+void
+psplash_console_vt_request (void)
 {
   DBG("mark, visible:%i", Visible);
 
+  if (ConsoleFd < 0)
+    return;
+
   if (Visible)
     {
       /* Allow Switch Away */
@@ -29,10 +34,7 @@ vt_request (int UNUSED(sig))
 
       /* FIXME:
        * We likely now want to signal the main loop as to exit
-       * and we've now likely switched to the X tty. Note, this
-       * seems to happen anyway atm due to select() call getting
-       * a signal interuption error - not sure if this is really
-       * reliable however.
+       * and we've now likely switched to the X tty.
       */
     }
   else
@@ -81,7 +83,8 @@ psplash_console_handle_switches (void)
       return;
     }
 
-  act.sa_handler = vt_request;
+  /* SIGUSR1 stays blocked and is read from the main loop's signalfd */
+  act.sa_handler = SIG_DFL;
   sigemptyset (&act.sa_mask);
   act.sa_flags = 0;
   sigaction (SIGUSR1, &act, 0);
@@ -176,6 +179,7 @@ psplash_console_reset (void)
   /* Cleanup */
 
   close(ConsoleFd);
+  ConsoleFd = -1;
 
   if ((fd = open ("/dev/tty0", O_RDWR|O_NDELAY, 0)) >= 0)
     {
@@ -16,4 +16,7 @@ psplash_console_switch (void);
 void
 psplash_console_reset (void);
 
+void
+psplash_console_vt_request (void);
+
 #endif
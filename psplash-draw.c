@@ -8,131 +8,1191 @@
  */
 
 #include "psplash-draw.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#define OFFSET(canvas, x, y) (((y) * (canvas)->stride) + ((x) * ((canvas)->bpp >> 3)))
+
+/* Byte offset of canvas position x,y in the buffer and the distance in
+ * bytes to the next pixel along a canvas row, for each angle. */
+#define SPAN_OFFSET_0(canvas, x, y)   OFFSET (canvas, x, y)
+#define SPAN_OFFSET_90(canvas, x, y)  OFFSET (canvas, y, (canvas)->width - (x) - 1)
+#define SPAN_OFFSET_180(canvas, x, y) OFFSET (canvas, (canvas)->width - (x) - 1, \
+					      (canvas)->height - (y) - 1)
+#define SPAN_OFFSET_270(canvas, x, y) OFFSET (canvas, (canvas)->height - (y) - 1, x)
+
+#define SPAN_STEP_0(canvas, bpp)      ((bpp) >> 3)
+#define SPAN_STEP_90(canvas, bpp)     (-(canvas)->stride)
+#define SPAN_STEP_180(canvas, bpp)    (-((bpp) >> 3))
+#define SPAN_STEP_270(canvas, bpp)    ((canvas)->stride)
+
+/* 24 bpp pixels are packed with the first byte in memory in the low bits */
+#define STORE_8(p, pixel)  (*(uint8 *) (p) = (pixel))
+#define STORE_16(p, pixel) (*(uint16_t *) (p) = (pixel))
+#define STORE_24(p, pixel) ((p)[0] = (pixel), (p)[1] = (pixel) >> 8, \
+			    (p)[2] = (pixel) >> 16)
+#define STORE_32(p, pixel) (*(uint32_t *) (p) = (pixel))
+
+#define LOAD_8(p)  (*(uint8 *) (p))
+#define LOAD_16(p) (*(uint16_t *) (p))
+#define LOAD_24(p) ((uint8) (p)[0] | ((uint8) (p)[1] << 8) | \
+		    ((uint32_t) (uint8) (p)[2] << 16))
+#define LOAD_32(p) (*(uint32_t *) (p))
+
+#define DEFINE_SPAN_WRITERS(bpp, angle)				\
+static void								\
+psplash_fill_span_##bpp##_##angle(PSplashCanvas *canvas,		\
+				  int            x,			\
+				  int            y,			\
+				  int            len,			\
+				  uint32_t       pixel)			\
+{									\
+  char      *p = canvas->data + SPAN_OFFSET_##angle (canvas, x, y);	\
+  const int  step = SPAN_STEP_##angle (canvas, bpp);			\
+									\
+  while (len--)								\
+    {									\
+      STORE_##bpp (p, pixel);						\
+      p += step;							\
+    }									\
+}									\
+									\
+static void								\
+psplash_put_span_##bpp##_##angle(PSplashCanvas  *canvas,		\
+				 int             x,			\
+				 int             y,			\
+				 int             len,			\
+				 const uint32_t *pixels)		\
+{									\
+  char      *p = canvas->data + SPAN_OFFSET_##angle (canvas, x, y);	\
+  const int  step = SPAN_STEP_##angle (canvas, bpp);			\
+									\
+  while (len--)								\
+    {									\
+      STORE_##bpp (p, *pixels);						\
+      pixels++;								\
+      p += step;							\
+    }									\
+}									\
+									\
+static void								\
+psplash_get_span_##bpp##_##angle(PSplashCanvas  *canvas,		\
+				 int             x,			\
+				 int             y,			\
+				 int             len,			\
+				 uint32_t       *pixels)		\
+{									\
+  char      *p = canvas->data + SPAN_OFFSET_##angle (canvas, x, y);	\
+  const int  step = SPAN_STEP_##angle (canvas, bpp);			\
+									\
+  while (len--)								\
+    {									\
+      *pixels++ = LOAD_##bpp (p);					\
+      p += step;							\
+    }									\
+}
+
+DEFINE_SPAN_WRITERS(8, 0)
+DEFINE_SPAN_WRITERS(8, 90)
+DEFINE_SPAN_WRITERS(8, 180)
+DEFINE_SPAN_WRITERS(8, 270)
+DEFINE_SPAN_WRITERS(16, 0)
+DEFINE_SPAN_WRITERS(16, 90)
+DEFINE_SPAN_WRITERS(16, 180)
+DEFINE_SPAN_WRITERS(16, 270)
+DEFINE_SPAN_WRITERS(24, 0)
+DEFINE_SPAN_WRITERS(24, 90)
+DEFINE_SPAN_WRITERS(24, 180)
+DEFINE_SPAN_WRITERS(24, 270)
+DEFINE_SPAN_WRITERS(32, 0)
+DEFINE_SPAN_WRITERS(32, 90)
+DEFINE_SPAN_WRITERS(32, 180)
+DEFINE_SPAN_WRITERS(32, 270)
+
+static void
+psplash_fill_span_none(PSplashCanvas *UNUSED(canvas),
+		       int            UNUSED(x),
+		       int            UNUSED(y),
+		       int            UNUSED(len),
+		       uint32_t       UNUSED(pixel))
+{
+  /* depth not supported yet */
+}
+
+static void
+psplash_put_span_none(PSplashCanvas  *UNUSED(canvas),
+		      int             UNUSED(x),
+		      int             UNUSED(y),
+		      int             UNUSED(len),
+		      const uint32_t *UNUSED(pixels))
+{
+  /* depth not supported yet */
+}
+
+static void
+psplash_get_span_none(PSplashCanvas  *UNUSED(canvas),
+		      int             UNUSED(x),
+		      int             UNUSED(y),
+		      int             len,
+		      uint32_t       *pixels)
+{
+  memset(pixels, 0, len * sizeof(uint32_t));
+}
+
+/* 8 bpp is only used for the alpha masks of decoded images */
+static void (* const fill_span_table[4][4])(PSplashCanvas *, int, int,
+					    int, uint32_t) = {
+  { psplash_fill_span_8_0, psplash_fill_span_8_90,
+    psplash_fill_span_8_180, psplash_fill_span_8_270 },
+  { psplash_fill_span_16_0, psplash_fill_span_16_90,
+    psplash_fill_span_16_180, psplash_fill_span_16_270 },
+  { psplash_fill_span_24_0, psplash_fill_span_24_90,
+    psplash_fill_span_24_180, psplash_fill_span_24_270 },
+  { psplash_fill_span_32_0, psplash_fill_span_32_90,
+    psplash_fill_span_32_180, psplash_fill_span_32_270 },
+};
+
+static void (* const put_span_table[4][4])(PSplashCanvas *, int, int,
+					   int, const uint32_t *) = {
+  { psplash_put_span_8_0, psplash_put_span_8_90,
+    psplash_put_span_8_180, psplash_put_span_8_270 },
+  { psplash_put_span_16_0, psplash_put_span_16_90,
+    psplash_put_span_16_180, psplash_put_span_16_270 },
+  { psplash_put_span_24_0, psplash_put_span_24_90,
+    psplash_put_span_24_180, psplash_put_span_24_270 },
+  { psplash_put_span_32_0, psplash_put_span_32_90,
+    psplash_put_span_32_180, psplash_put_span_32_270 },
+};
+
+static void (* const get_span_table[4][4])(PSplashCanvas *, int, int,
+					   int, uint32_t *) = {
+  { psplash_get_span_8_0, psplash_get_span_8_90,
+    psplash_get_span_8_180, psplash_get_span_8_270 },
+  { psplash_get_span_16_0, psplash_get_span_16_90,
+    psplash_get_span_16_180, psplash_get_span_16_270 },
+  { psplash_get_span_24_0, psplash_get_span_24_90,
+    psplash_get_span_24_180, psplash_get_span_24_270 },
+  { psplash_get_span_32_0, psplash_get_span_32_90,
+    psplash_get_span_32_180, psplash_get_span_32_270 },
+};
+
+/* Rotated canvases are drawn in square tiles of this many pixels, see
+ * psplash_put_block() */
+#define BLOCK_TILE 16
+
+/* Write len pixels, taken every pitch entries from pixels and skipping those
+ * whose byte in mask (taken every mask_pitch bytes) isn't 0xff, moving step
+ * bytes along a buffer row */
+#define DEFINE_PUT_COLUMN(bpp)						\
+static void								\
+psplash_put_column_##bpp(char           *p,				\
+			 int             step,				\
+			 int             len,				\
+			 const uint32_t *pixels,			\
+			 int             pitch,				\
+			 const uint8    *mask,				\
+			 int             mask_pitch)			\
+{									\
+  for (; len--; p += step, pixels += pitch, mask += mask_pitch)		\
+    if (*mask == 0xff)							\
+      STORE_##bpp (p, *pixels);						\
+}
+
+DEFINE_PUT_COLUMN(8)
+DEFINE_PUT_COLUMN(16)
+DEFINE_PUT_COLUMN(24)
+DEFINE_PUT_COLUMN(32)
+
+static uint32_t
+psplash_pack_rgb565(PSplashCanvas *UNUSED(canvas),
+		    uint8 red, uint8 green, uint8 blue)
+{
+  return ((red >> 3) << 11) | ((green >> 2) << 5) | (blue >> 3);
+}
+
+static uint32_t
+psplash_pack_bgr565(PSplashCanvas *UNUSED(canvas),
+		    uint8 red, uint8 green, uint8 blue)
+{
+  return ((blue >> 3) << 11) | ((green >> 2) << 5) | (red >> 3);
+}
+
+static uint32_t
+psplash_pack_rgb888(PSplashCanvas *UNUSED(canvas),
+		    uint8 red, uint8 green, uint8 blue)
+{
+  return (red << 16) | (green << 8) | (blue);
+}
+
+static uint32_t
+psplash_pack_bgr888(PSplashCanvas *UNUSED(canvas),
+		    uint8 red, uint8 green, uint8 blue)
+{
+  return (blue << 16) | (green << 8) | (red);
+}
+
+static uint32_t
+psplash_pack_generic(PSplashCanvas *canvas,
+		     uint8 red, uint8 green, uint8 blue)
+{
+  return ((uint32_t) (red >> (8 - canvas->red_length)) << canvas->red_offset)
+	  | ((uint32_t) (green >> (8 - canvas->green_length)) << canvas->green_offset)
+	  | ((uint32_t) (blue >> (8 - canvas->blue_length)) << canvas->blue_offset);
+}
+
+/* Unpack functions return the color of a native pixel as 0xRRGGBB */
+static uint32_t
+psplash_unpack_rgb565(PSplashCanvas *UNUSED(canvas), uint32_t pixel)
+{
+  uint32_t r = (pixel >> 11) & 0x1f, g = (pixel >> 5) & 0x3f, b = pixel & 0x1f;
+
+  return (((r << 3) | (r >> 2)) << 16) | (((g << 2) | (g >> 4)) << 8)
+	  | ((b << 3) | (b >> 2));
+}
+
+static uint32_t
+psplash_unpack_bgr565(PSplashCanvas *UNUSED(canvas), uint32_t pixel)
+{
+  uint32_t b = (pixel >> 11) & 0x1f, g = (pixel >> 5) & 0x3f, r = pixel & 0x1f;
+
+  return (((r << 3) | (r >> 2)) << 16) | (((g << 2) | (g >> 4)) << 8)
+	  | ((b << 3) | (b >> 2));
+}
+
+static uint32_t
+psplash_unpack_rgb888(PSplashCanvas *UNUSED(canvas), uint32_t pixel)
+{
+  return pixel & 0xffffff;
+}
+
+static uint32_t
+psplash_unpack_bgr888(PSplashCanvas *UNUSED(canvas), uint32_t pixel)
+{
+  return ((pixel & 0xff) << 16) | (pixel & 0xff00) | ((pixel >> 16) & 0xff);
+}
+
+/* Scale a channel of length bits up to 8 bits */
+static inline uint32_t
+psplash_expand_channel(uint32_t pixel, int offset, int length)
+{
+  uint32_t c = (pixel >> offset) & ((1u << length) - 1);
+
+  if (length >= 8)
+    return c >> (length - 8);
+
+  c <<= 8 - length;
+  return c | (c >> length);
+}
+
+static uint32_t
+psplash_unpack_generic(PSplashCanvas *canvas, uint32_t pixel)
+{
+  return (psplash_expand_channel(pixel, canvas->red_offset,
+				 canvas->red_length) << 16)
+	  | (psplash_expand_channel(pixel, canvas->green_offset,
+				    canvas->green_length) << 8)
+	  | psplash_expand_channel(pixel, canvas->blue_offset,
+				   canvas->blue_length);
+}
+
+/* Row of the span writer tables for a depth, or -1 */
+static int
+psplash_depth_index(int bpp)
+{
+  switch (bpp)
+    {
+    case 8:
+      return 0;
+    case 16:
+      return 1;
+    case 24:
+      return 2;
+    case 32:
+      return 3;
+    default:
+      return -1;
+    }
+}
+
+/* Column of the span writer tables for an angle */
+static int
+psplash_angle_index(int angle)
+{
+  switch (angle)
+    {
+    case 270:
+      return 3;
+    case 180:
+      return 2;
+    case 90:
+      return 1;
+    case 0:
+    default:
+      return 0;
+    }
+}
+
+void
+psplash_canvas_setup(PSplashCanvas *canvas)
+{
+  int bgr = (canvas->rgbmode == BGR565 || canvas->rgbmode == BGR888);
+  int angle = psplash_angle_index(canvas->angle);
+  int depth;
+
+  canvas->n_damage = 0;
+  psplash_canvas_set_clip(canvas, 0, 0, canvas->width, canvas->height);
+  canvas->fill_span = psplash_fill_span_none;
+  canvas->put_span = psplash_put_span_none;
+  canvas->get_span = psplash_get_span_none;
+  canvas->pack = psplash_pack_generic;
+  canvas->unpack = psplash_unpack_generic;
+
+  switch (canvas->bpp)
+    {
+    case 16:
+      if (canvas->rgbmode != GENERIC)
+	{
+	  canvas->pack = bgr ? psplash_pack_bgr565 : psplash_pack_rgb565;
+	  canvas->unpack = bgr ? psplash_unpack_bgr565 : psplash_unpack_rgb565;
+	}
+      break;
+    case 24:
+      if (canvas->rgbmode == GENERIC)
+	return;
+#if __BYTE_ORDER == __BIG_ENDIAN
+      bgr = !bgr;
+#endif
+      canvas->pack = bgr ? psplash_pack_bgr888 : psplash_pack_rgb888;
+      canvas->unpack = bgr ? psplash_unpack_bgr888 : psplash_unpack_rgb888;
+      break;
+    case 32:
+      if (canvas->rgbmode != GENERIC)
+	{
+	  canvas->pack = bgr ? psplash_pack_bgr888 : psplash_pack_rgb888;
+	  canvas->unpack = bgr ? psplash_unpack_bgr888 : psplash_unpack_rgb888;
+	}
+      break;
+    default:
+      return;
+    }
+
+  depth = psplash_depth_index(canvas->bpp);
+  canvas->fill_span = fill_span_table[depth][angle];
+  canvas->put_span = put_span_table[depth][angle];
+  canvas->get_span = get_span_table[depth][angle];
+}
+
+/* Blend len 0xRRGGBB source colors over as many 0xRRGGBB destination
+ * colors in place, source-over with the given alphas:
+ *   dst = (src * alpha + dst * (255 - alpha)) / 255
+ * rounded, computed in 16 bit lanes where SIMD is available. */
+static void
+psplash_blend_kernel(uint32_t       *dst,
+		     const uint32_t *src,
+		     const uint8    *alpha,
+		     int             len)
+{
+  int i = 0;
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i c128 = _mm_set1_epi16(128);
+  const __m128i c255 = _mm_set1_epi16(255);
+
+  for (; i + 4 <= len; i += 4)
+    {
+      __m128i s = _mm_loadu_si128((const __m128i *) (src + i));
+      __m128i d = _mm_loadu_si128((const __m128i *) (dst + i));
+      __m128i a, alo, ahi, lo, hi;
+      uint32_t a4;
+
+      /* Replicate each alpha over the four bytes of its pixel */
+      memcpy(&a4, alpha + i, 4);
+      a = _mm_cvtsi32_si128(a4);
+      a = _mm_unpacklo_epi8(a, a);
+      a = _mm_unpacklo_epi16(a, a);
+      alo = _mm_unpacklo_epi8(a, zero);
+      ahi = _mm_unpackhi_epi8(a, zero);
+
+      lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), alo),
+			 _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero),
+					 _mm_sub_epi16(c255, alo)));
+      hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), ahi),
+			 _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero),
+					 _mm_sub_epi16(c255, ahi)));
+
+      /* x / 255 == (x + 128 + ((x + 128) >> 8)) >> 8 for x <= 255 * 255 */
+      lo = _mm_add_epi16(lo, c128);
+      hi = _mm_add_epi16(hi, c128);
+      lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+      hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+
+      _mm_storeu_si128((__m128i *) (dst + i), _mm_packus_epi16(lo, hi));
+    }
+#elif defined(__ARM_NEON)
+  for (; i + 2 <= len; i += 2)
+    {
+      uint8x8_t  s = vreinterpret_u8_u32(vld1_u32(src + i));
+      uint8x8_t  d = vreinterpret_u8_u32(vld1_u32(dst + i));
+      uint8x8_t  a;
+      uint16x8_t x;
+
+      /* Replicate each alpha over the four bytes of its pixel */
+      a = vreinterpret_u8_u32(vset_lane_u32(alpha[i + 1] * 0x01010101u,
+					    vdup_n_u32(alpha[i] * 0x01010101u),
+					    1));
+
+      x = vmull_u8(s, a);
+      x = vmlal_u8(x, d, vmvn_u8(a));
+
+      /* x / 255 == (x + 128 + ((x + 128) >> 8)) >> 8 for x <= 255 * 255 */
+      vst1_u32(dst + i, vreinterpret_u32_u8(vraddhn_u16(x, vrshrq_n_u16(x, 8))));
+    }
+#endif
+
+  for (; i < len; i++)
+    {
+      uint32_t out = 0;
+      int      shift;
+
+      for (shift = 0; shift < 24; shift += 8)
+	{
+	  uint32_t x = ((src[i] >> shift) & 0xff) * alpha[i]
+		       + ((dst[i] >> shift) & 0xff) * (255 - alpha[i]) + 128;
+
+	  out |= ((x + (x >> 8)) >> 8) << shift;
+	}
+      dst[i] = out;
+    }
+}
+
+/* Number of pixels blended per batch */
+#define BLEND_CHUNK 128
+
+/* Blend len 0xRRGGBB source colors with the given alphas over len packed
+ * native pixels, in place */
+static void
+psplash_blend(PSplashCanvas  *canvas,
+	      uint32_t       *pixels,
+	      const uint32_t *src,
+	      const uint8    *alpha,
+	      int             len)
+{
+  uint32_t rgb[BLEND_CHUNK];
+  int      i, n;
+
+  for (; len > 0; len -= n, pixels += n, src += n, alpha += n)
+    {
+      n = MIN(len, BLEND_CHUNK);
+
+      for (i = 0; i < n; i++)
+	rgb[i] = canvas->unpack(canvas, pixels[i]);
+
+      psplash_blend_kernel(rgb, src, alpha, n);
+
+      for (i = 0; i < n; i++)
+	pixels[i] = canvas->pack(canvas, rgb[i] >> 16, rgb[i] >> 8, rgb[i]);
+    }
+}
+
+/* Blend a run of at most BLEND_CHUNK source colors over the canvas along a
+ * canvas row. No clipping is done. */
+static void
+psplash_blend_span(PSplashCanvas  *canvas,
+		   int             x,
+		   int             y,
+		   int             len,
+		   const uint32_t *src,
+		   const uint8    *alpha)
+{
+  uint32_t pixels[BLEND_CHUNK];
+
+  canvas->get_span(canvas, x, y, len, pixels);
+  psplash_blend(canvas, pixels, src, alpha, len);
+  canvas->put_span(canvas, x, y, len, pixels);
+}
+
+/* Fill len pixels of a buffer row starting at p with a packed pixel, using
+ * the widest stores available */
+static void
+psplash_fill_row(char *p, int len, int bpp, uint32_t pixel)
+{
+  uint64_t pattern;
+  int      bytes;
+
+  if (bpp == 24)
+    {
+      /* 24 bpp has no power of two period, so store a 48 byte pattern */
+      char block[48];
+      int  i;
+
+      for (i = 0; i < 48; i += 3)
+	STORE_24(block + i, pixel);
+
+      for (bytes = len * 3; bytes >= 48; bytes -= 48, p += 48)
+	memcpy(p, block, 48);
+      memcpy(p, block, bytes);
+      return;
+    }
+
+  bytes = len * (bpp >> 3);
+
+  if (bpp == 16)
+    {
+      pattern = pixel & 0xffff;
+      pattern |= pattern << 16;
+
+      for (; bytes >= 2 && ((uintptr_t) p & 7); bytes -= 2, p += 2)
+	STORE_16(p, pixel);
+    }
+  else
+    {
+      pattern = pixel;
+
+      for (; bytes >= 4 && ((uintptr_t) p & 7); bytes -= 4, p += 4)
+	STORE_32(p, pixel);
+    }
+  pattern |= pattern << 32;
+
+#if defined(__SSE2__)
+  {
+    __m128i v = _mm_set1_epi64x(pattern);
+
+    for (; bytes >= 16; bytes -= 16, p += 16)
+      _mm_storeu_si128((__m128i *) p, v);
+  }
+#elif defined(__ARM_NEON)
+  {
+    uint64x2_t v = vdupq_n_u64(pattern);
+
+    for (; bytes >= 16; bytes -= 16, p += 16)
+      vst1q_u64((uint64_t *) p, v);
+  }
+#endif
+
+  for (; bytes >= 8; bytes -= 8, p += 8)
+    *(uint64_t *) p = pattern;
+  for (; bytes >= 4; bytes -= 4, p += 4)
+    STORE_32(p, pattern);
+  for (; bytes >= 2; bytes -= 2, p += 2)
+    STORE_16(p, pattern);
+}
+
+/* Clip len pixels of an image row, starting at image column dx, against
+ * the image width and the canvas. x,y is where the image row starts on the
+ * canvas. Returns the number of visible pixels, the number of leading
+ * pixels clipped away is stored in skip. */
+static inline int
+psplash_clip_run(PSplashCanvas *canvas,
+		 int            x,
+		 int            y,
+		 int            dx,
+		 int            len,
+		 int            img_width,
+		 int           *skip)
+{
+  int start = dx, stop = dx + len;
+
+  *skip = 0;
+  if (y < canvas->clip.y || y >= canvas->clip.y + canvas->clip.height)
+    return 0;
+
+  if (stop > img_width)
+    stop = img_width;
+  if (start < canvas->clip.x - x)
+    start = canvas->clip.x - x;
+  if (stop > canvas->clip.x + canvas->clip.width - x)
+    stop = canvas->clip.x + canvas->clip.width - x;
+
+  *skip = start - dx;
+  return stop - start;
+}
+
+/* Clip a rectangle to the given bounds, returns FALSE if nothing is left */
+static int
+psplash_clip_to(const PSplashRect *bounds,
+		int               *x,
+		int               *y,
+		int               *width,
+		int               *height)
+{
+  if (*x < bounds->x)
+    {
+      *width -= bounds->x - *x;
+      *x = bounds->x;
+    }
+  if (*y < bounds->y)
+    {
+      *height -= bounds->y - *y;
+      *y = bounds->y;
+    }
+  if (*width > bounds->x + bounds->width - *x)
+    *width = bounds->x + bounds->width - *x;
+  if (*height > bounds->y + bounds->height - *y)
+    *height = bounds->y + bounds->height - *y;
+
+  return *width > 0 && *height > 0;
+}
+
+/* Clip a rectangle to the canvas, returns FALSE if nothing is left */
+static int
+psplash_clip_rect(PSplashCanvas *canvas,
+		  int           *x,
+		  int           *y,
+		  int           *width,
+		  int           *height)
+{
+  return psplash_clip_to(&canvas->clip, x, y, width, height);
+}
+
+/* Limit drawing to a rectangle of the canvas, such as the part a layer
+ * shows. An empty clip is left if the rectangle is off the canvas. */
+void
+psplash_canvas_set_clip(PSplashCanvas *canvas,
+			int            x,
+			int            y,
+			int            width,
+			int            height)
+{
+  PSplashRect all = { 0, 0, canvas->width, canvas->height };
+
+  if (!psplash_clip_to(&all, &x, &y, &width, &height))
+    x = y = width = height = 0;
+
+  canvas->clip.x      = x;
+  canvas->clip.y      = y;
+  canvas->clip.width  = width;
+  canvas->clip.height = height;
+}
+
+/* Map a rectangle on a width x height area rotated by angle onto the
+ * unrotated buffer behind it, where it is a rectangle again */
+static void
+psplash_map_rect(int  angle,
+		 int  width,
+		 int  height,
+		 int  x,
+		 int  y,
+		 int  w,
+		 int  h,
+		 int *px,
+		 int *py,
+		 int *pw,
+		 int *ph)
+{
+  switch (angle)
+    {
+    case 270:
+      *px = height - y - h;
+      *py = x;
+      *pw = h;
+      *ph = w;
+      break;
+    case 180:
+      *px = width - x - w;
+      *py = height - y - h;
+      *pw = w;
+      *ph = h;
+      break;
+    case 90:
+      *px = y;
+      *py = width - x - w;
+      *pw = h;
+      *ph = w;
+      break;
+    case 0:
+    default:
+      *px = x;
+      *py = y;
+      *pw = w;
+      *ph = h;
+      break;
+    }
+}
+
+/* Write a w x h block of packed pixels to a 90 or 270 degree canvas at x,y.
+ * pixels and mask are in canvas row order with pitch and mask_pitch entries
+ * per row; only entries whose mask byte is 0xff are written, the partially
+ * transparent ones are left to the caller. A pitch of 0 writes the same
+ * pixel everywhere. No clipping is done.
+ *
+ * On these canvases a canvas row runs down a buffer column, so the block
+ * is transposed in BLOCK_TILE square tiles. Each canvas column of a tile is
+ * a short run of adjacent buffer pixels, and a tile only touches BLOCK_TILE
+ * buffer rows, which keeps the stores within a few cache lines. */
+static void
+psplash_put_block(PSplashCanvas  *canvas,
+		  int             x,
+		  int             y,
+		  int             w,
+		  int             h,
+		  const uint32_t *pixels,
+		  int             pitch,
+		  const uint8    *mask,
+		  int             mask_pitch)
+{
+  void (*put_column)(char *, int, int, const uint32_t *, int,
+		     const uint8 *, int);
+  int   tx, ty, cx, n, m, off, step;
+
+  switch (canvas->bpp)
+    {
+    case 8:
+      put_column = psplash_put_column_8;
+      break;
+    case 16:
+      put_column = psplash_put_column_16;
+      break;
+    case 24:
+      put_column = psplash_put_column_24;
+      break;
+    case 32:
+      put_column = psplash_put_column_32;
+      break;
+    default:
+      return;
+    }
+
+  /* Moving down a canvas column moves along a buffer row */
+  step = (canvas->angle == 90) ? (canvas->bpp >> 3) : -(canvas->bpp >> 3);
+
+  for (ty = 0; ty < h; ty += BLOCK_TILE)
+    for (tx = 0; tx < w; tx += BLOCK_TILE)
+      {
+	n = MIN(BLOCK_TILE, h - ty);
+	m = MIN(BLOCK_TILE, w - tx);
+
+	for (cx = tx; cx < tx + m; cx++)
+	  {
+	    if (canvas->angle == 90)
+	      off = SPAN_OFFSET_90 (canvas, x + cx, y + ty);
+	    else
+	      off = SPAN_OFFSET_270 (canvas, x + cx, y + ty);
+
+	    put_column(canvas->data + off, step, n,
+		       pixels + (pitch ? ty * pitch + cx : 0), pitch,
+		       mask + ty * mask_pitch + cx, mask_pitch);
+	  }
+      }
+}
+
+/* Add a rectangle in buffer coordinates to the damage of a canvas. Once
+ * all slots are used it is merged with the rectangle it grows least. */
+static void
+psplash_add_damage(PSplashCanvas *canvas,
+		   int            x,
+		   int            y,
+		   int            width,
+		   int            height)
+{
+  PSplashRect *r, *best = NULL;
+  int          i, x2, y2, grow, best_grow = INT_MAX;
+
+  for (i = 0; i < canvas->n_damage; i++)
+    {
+      r = &canvas->damage[i];
+
+      x2 = MAX(r->x + r->width, x + width) - MIN(r->x, x);
+      y2 = MAX(r->y + r->height, y + height) - MIN(r->y, y);
+      grow = x2 * y2 - r->width * r->height;
+
+      if (grow == 0)
+	return;
+
+      if (grow < best_grow)
+	{
+	  best = r;
+	  best_grow = grow;
+	}
+    }
+
+  if (canvas->n_damage < PSPLASH_MAX_DAMAGE)
+    {
+      r = &canvas->damage[canvas->n_damage++];
+      r->x      = x;
+      r->y      = y;
+      r->width  = width;
+      r->height = height;
+      return;
+    }
+
+  x2 = MAX(best->x + best->width, x + width);
+  y2 = MAX(best->y + best->height, y + height);
+  best->x      = MIN(best->x, x);
+  best->y      = MIN(best->y, y);
+  best->width  = x2 - best->x;
+  best->height = y2 - best->y;
+}
+
+/* Clip a rectangle to the canvas and map it onto the unrotated buffer,
+ * leaving it empty if nothing is left */
+void
+psplash_canvas_map_rect(PSplashCanvas *canvas,
+			PSplashRect   *rect)
+{
+  if (!psplash_clip_rect(canvas, &rect->x, &rect->y,
+			 &rect->width, &rect->height))
+    {
+      rect->width = rect->height = 0;
+      return;
+    }
+
+  psplash_map_rect(canvas->angle, canvas->width, canvas->height,
+		   rect->x, rect->y, rect->width, rect->height,
+		   &rect->x, &rect->y, &rect->width, &rect->height);
+}
+
+/* Record that a rectangle of the canvas is about to be drawn */
+void
+psplash_canvas_damage(PSplashCanvas *canvas,
+		      int            x,
+		      int            y,
+		      int            width,
+		      int            height)
+{
+  int px, py, pw, ph;
+
+  if (!psplash_clip_rect(canvas, &x, &y, &width, &height))
+    return;
+
+  psplash_map_rect(canvas->angle, canvas->width, canvas->height,
+		   x, y, width, height, &px, &py, &pw, &ph);
+  psplash_add_damage(canvas, px, py, pw, ph);
+}
+
+/* Copy the damaged areas of the canvas from the buffer at src to the one at
+ * dst, both laid out like the canvas, and forget the damage */
+void
+psplash_canvas_sync_damage(PSplashCanvas *canvas,
+			   char          *dst,
+			   const char    *src)
+{
+  PSplashRect *r;
+  int          i, dy, off;
+
+  for (i = 0; i < canvas->n_damage; i++)
+    {
+      r = &canvas->damage[i];
+      off = OFFSET (canvas, r->x, r->y);
+
+      for (dy = 0; dy < r->height; dy++, off += canvas->stride)
+	memcpy(dst + off, src + off, r->width * (canvas->bpp >> 3));
+    }
+
+  canvas->n_damage = 0;
+}
+
+void
+psplash_draw_rect(PSplashCanvas *canvas,
+		  int            x,
+		  int            y,
+		  int            width,
+		  int            height,
+		  uint8          red,
+		  uint8          green,
+		  uint8          blue)
+{
+  uint32_t pixel;
+  char    *row;
+  int      dy, px, py, pw, ph;
+
+  if (!psplash_clip_rect(canvas, &x, &y, &width, &height))
+    return;
+
+  if (canvas->fill_span == psplash_fill_span_none)
+    return;
+
+  /* Fill the rectangle row by row as it lies in the unrotated buffer */
+  psplash_map_rect(canvas->angle, canvas->width, canvas->height,
+		   x, y, width, height, &px, &py, &pw, &ph);
+  psplash_add_damage(canvas, px, py, pw, ph);
+
+  pixel = canvas->pack(canvas, red, green, blue);
+  row = canvas->data + OFFSET (canvas, px, py);
+
+  /* Every row is stored rather than copied from the first one, since the
+   * buffer is often uncached framebuffer memory that is slow to read */
+  for (dy = 0; dy < ph; dy++, row += canvas->stride)
+    psplash_fill_row(row, pw, canvas->bpp, pixel);
+}
+
+/* How a decoded image pixel is written, by its alpha. With an alpha canvas
+ * every pixel that isn't fully transparent is copied unblended. */
+enum {
+  PIXEL_TRANSPARENT,
+  PIXEL_OPAQUE,
+  PIXEL_BLENDED,
+};
+
+static inline int
+psplash_pixel_kind(int alpha, PSplashCanvas *alpha_canvas)
+{
+  if (alpha == 0)
+    return PIXEL_TRANSPARENT;
+  if (alpha == 255 || alpha_canvas)
+    return PIXEL_OPAQUE;
+  return PIXEL_BLENDED;
+}
+
+/* Write n decoded image pixels of one kind along a canvas row. rgba holds
+ * the source pixels img_bytes_per_pixel apart, or a single pixel repeated n
+ * times if repeat is set. */
+static void
+psplash_put_image_run(PSplashCanvas *canvas,
+		      PSplashCanvas *alpha_canvas,
+		      int            x,
+		      int            y,
+		      int            n,
+		      int            kind,
+		      const uint8   *rgba,
+		      int            img_bytes_per_pixel,
+		      int            repeat)
+{
+  uint32_t pixels[128], alphas[128];
+  uint8    alpha[128];
+  int      i, step = repeat ? 0 : img_bytes_per_pixel;
+
+  if (kind == PIXEL_TRANSPARENT)
+    return;
+
+  if (kind == PIXEL_BLENDED)
+    {
+      for (i = 0; i < n; i++, rgba += step)
+	{
+	  pixels[i] = (*(rgba) << 16) | (*(rgba+1) << 8) | *(rgba+2);
+	  alpha[i] = *(rgba+3);
+	}
+      psplash_blend_span(canvas, x, y, n, pixels, alpha);
+      return;
+    }
+
+  if (repeat)
+    {
+      canvas->fill_span(canvas, x, y, n,
+			canvas->pack(canvas, *(rgba), *(rgba+1), *(rgba+2)));
+      if (alpha_canvas)
+	alpha_canvas->fill_span(alpha_canvas, x, y, n,
+				img_bytes_per_pixel < 4 ? 255 : *(rgba+3));
+      return;
+    }
+
+  for (i = 0; i < n; i++, rgba += step)
+    {
+      pixels[i] = canvas->pack(canvas, *(rgba), *(rgba+1), *(rgba+2));
+      alphas[i] = img_bytes_per_pixel < 4 ? 255 : *(rgba+3);
+    }
+  canvas->put_span(canvas, x, y, n, pixels);
+  if (alpha_canvas)
+    alpha_canvas->put_span(alpha_canvas, x, y, n, alphas);
+}
+
+/* Decode an RLE image onto a canvas. Without an alpha canvas, partially
+ * transparent pixels are blended over the canvas. With one, which must
+ * have the same geometry and 8 bpp, pixels are copied unblended and their
+ * alpha written to it instead. */
+static void
+psplash_decode_image(PSplashCanvas *canvas,
+		     PSplashCanvas *alpha_canvas,
+		     int            x,
+		     int            y,
+		     int            img_width,
+		     int            img_height,
+		     int            img_bytes_per_pixel,
+		     int            img_rowstride,
+		     uint8         *rle_data)
+{
+  uint8       *p = rle_data, *end;
+  int          dx = 0, dy = 0, row_len, n, skip, vis, i, j, kind;
+  unsigned int len;
+
+  /* Pixels in a row of the RLE stream, including any rowstride padding */
+  row_len = (img_rowstride + img_bytes_per_pixel - 1) / img_bytes_per_pixel;
+  end = rle_data + img_rowstride * img_height;
+
+#define ALPHA(p) (img_bytes_per_pixel < 4 ? 255 : *((p)+3))
+
+  while (p < end && dy < img_height)
+    {
+      len = *(p++);
+
+      if (len & 128)
+	{
+	  len -= 128;
+
+	  if (len == 0) break;
+
+	  /* A repeat run is one clipped span per image row it covers */
+	  kind = psplash_pixel_kind(ALPHA(p), alpha_canvas);
+
+	  while (len && dy < img_height)
+	    {
+	      n = MIN((int)len, row_len - dx);
+	      vis = psplash_clip_run(canvas, x, y + dy, dx, n, img_width, &skip);
+
+	      if (vis > 0)
+		psplash_put_image_run(canvas, alpha_canvas, x + dx + skip,
+				      y + dy, vis, kind, p,
+				      img_bytes_per_pixel, TRUE);
+
+	      len -= n;
+	      dx += n;
+	      if (dx == row_len)
+		{
+		  dx = 0;
+		  dy++;
+		}
+	    }
+
+	  p += img_bytes_per_pixel;
+	}
+      else
+	{
+	  if (len == 0) break;
+
+	  /* A literal run is written one row piece at a time, split where
+	   * the kind of pixel changes */
+	  len = MIN(len, (unsigned int) ((end - p + img_bytes_per_pixel - 1)
+					 / img_bytes_per_pixel));
+
+	  while (len && dy < img_height)
+	    {
+	      uint8 *src;
+
+	      n = MIN((int)len, row_len - dx);
+	      vis = psplash_clip_run(canvas, x, y + dy, dx, n, img_width, &skip);
+
+	      src = p + skip * img_bytes_per_pixel;
+	      for (i = 0; i < vis; i = j)
+		{
+		  kind = psplash_pixel_kind(ALPHA(src + i * img_bytes_per_pixel),
+					    alpha_canvas);
+		  for (j = i + 1;
+		       j < vis
+		       && psplash_pixel_kind(ALPHA(src + j * img_bytes_per_pixel),
+					     alpha_canvas) == kind;
+		       j++)
+		    ;
+		  psplash_put_image_run(canvas, alpha_canvas,
+					x + dx + skip + i, y + dy, j - i, kind,
+					src + i * img_bytes_per_pixel,
+					img_bytes_per_pixel, FALSE);
+		}
+
+	      p += n * img_bytes_per_pixel;
+	      len -= n;
+	      dx += n;
+	      if (dx == row_len)
+		{
+		  dx = 0;
+		  dy++;
+		}
+	    }
+	}
+    }
 
-#define OFFSET(canvas, x, y) (((y) * (canvas)->stride) + ((x) * ((canvas)->bpp >> 3)))
+#undef ALPHA
+}
 
-static inline void
-psplash_plot_pixel(PSplashCanvas *canvas,
-		   int            x,
-		   int            y,
-		   uint8          red,
-		   uint8          green,
-		   uint8          blue)
+/* Decode an image into unrotated buffers of packed pixels and alpha,
+ * sharing the canvas' format. Returns FALSE if they can't be allocated. */
+static int
+psplash_decode_image_unrotated(PSplashCanvas *canvas,
+			       int            img_width,
+			       int            img_height,
+			       int            img_bytes_per_pixel,
+			       int            img_rowstride,
+			       uint8         *rle_data,
+			       uint32_t     **pixels,
+			       uint8        **alpha)
 {
-  /* Always write to back data (data) which points to the right data with or
-   * without double buffering support */
-  int off;
+  PSplashCanvas sc, ac;
 
-  if (x < 0 || x > canvas->width-1 || y < 0 || y > canvas->height-1)
-    return;
+  *pixels = malloc(img_width * img_height * sizeof(uint32_t));
+  *alpha = calloc(img_width * img_height, 1);
 
-  switch (canvas->angle)
+  if (*pixels == NULL || *alpha == NULL)
     {
-    case 270:
-      off = OFFSET (canvas, canvas->height - y - 1, x);
-      break;
-    case 180:
-      off = OFFSET (canvas, canvas->width - x - 1, canvas->height - y - 1);
-      break;
-    case 90:
-      off = OFFSET (canvas, y, canvas->width - x - 1);
-      break;
-    case 0:
-    default:
-      off = OFFSET (canvas, x, y);
-      break;
+      free(*pixels);
+      free(*alpha);
+      return FALSE;
     }
 
-  if (canvas->rgbmode == RGB565 || canvas->rgbmode == RGB888) {
-    switch (canvas->bpp)
-      {
-      case 24:
-#if __BYTE_ORDER == __BIG_ENDIAN
-        *(canvas->data + off + 0) = red;
-        *(canvas->data + off + 1) = green;
-        *(canvas->data + off + 2) = blue;
-#else
-        *(canvas->data + off + 0) = blue;
-        *(canvas->data + off + 1) = green;
-        *(canvas->data + off + 2) = red;
-#endif
-        break;
-      case 32:
-        *(volatile uint32_t *) (canvas->data + off)
-          = (red << 16) | (green << 8) | (blue);
-        break;
-
-      case 16:
-        *(volatile uint16_t *) (canvas->data + off)
-	  = ((red >> 3) << 11) | ((green >> 2) << 5) | (blue >> 3);
-        break;
-      default:
-        /* depth not supported yet */
-        break;
-      }
-  } else if (canvas->rgbmode == BGR565 || canvas->rgbmode == BGR888) {
-    switch (canvas->bpp)
-      {
-      case 24:
-#if __BYTE_ORDER == __BIG_ENDIAN
-        *(canvas->data + off + 0) = blue;
-        *(canvas->data + off + 1) = green;
-        *(canvas->data + off + 2) = red;
-#else
-        *(canvas->data + off + 0) = red;
-        *(canvas->data + off + 1) = green;
-        *(canvas->data + off + 2) = blue;
-#endif
-        break;
-      case 32:
-        *(volatile uint32_t *) (canvas->data + off)
-          = (blue << 16) | (green << 8) | (red);
-        break;
-      case 16:
-        *(volatile uint16_t *) (canvas->data + off)
-	  = ((blue >> 3) << 11) | ((green >> 2) << 5) | (red >> 3);
-        break;
-      default:
-        /* depth not supported yet */
-        break;
-      }
-  } else {
-    switch (canvas->bpp)
-      {
-      case 32:
-        *(volatile uint32_t *) (canvas->data + off)
-	  = ((red >> (8 - canvas->red_length)) << canvas->red_offset)
-	      | ((green >> (8 - canvas->green_length)) << canvas->green_offset)
-	      | ((blue >> (8 - canvas->blue_length)) << canvas->blue_offset);
-        break;
-      case 16:
-        *(volatile uint16_t *) (canvas->data + off)
-	  = ((red >> (8 - canvas->red_length)) << canvas->red_offset)
-	      | ((green >> (8 - canvas->green_length)) << canvas->green_offset)
-	      | ((blue >> (8 - canvas->blue_length)) << canvas->blue_offset);
-        break;
-      default:
-        /* depth not supported yet */
-        break;
-      }
-  }
+  sc           = *canvas;
+  sc.angle     = 0;
+  sc.width     = img_width;
+  sc.height    = img_height;
+  sc.bpp       = 32;
+  sc.stride    = img_width * sizeof(uint32_t);
+  sc.data      = (char *) *pixels;
+  sc.fill_span = fill_span_table[3][0];
+  sc.put_span  = put_span_table[3][0];
+  psplash_canvas_set_clip(&sc, 0, 0, img_width, img_height);
+
+  ac           = sc;
+  ac.bpp       = 8;
+  ac.stride    = img_width;
+  ac.data      = (char *) *alpha;
+  ac.fill_span = fill_span_table[0][0];
+  ac.put_span  = put_span_table[0][0];
+
+  psplash_decode_image(&sc, &ac, 0, 0, img_width, img_height,
+		       img_bytes_per_pixel, img_rowstride, rle_data);
+  return TRUE;
 }
 
-void
-psplash_draw_rect(PSplashCanvas *canvas,
-		  int            x,
-		  int            y,
-		  int            width,
-		  int            height,
-		  uint8          red,
-		  uint8          green,
-		  uint8          blue)
+/* Decode an image into unrotated scratch buffers, write its opaque pixels
+ * with psplash_put_block() and blend the partially transparent ones. Returns
+ * FALSE if the scratch buffers can't be allocated. */
+static int
+psplash_draw_image_rotated(PSplashCanvas *canvas,
+			   int            x,
+			   int            y,
+			   int            img_width,
+			   int            img_height,
+			   int            img_bytes_per_pixel,
+			   int            img_rowstride,
+			   uint8         *rle_data)
 {
-  int dx, dy;
+  uint32_t *pixels, src[BLEND_CHUNK];
+  uint8    *alpha, *a;
+  int       sx = x, sy = y, w = img_width, h = img_height, off, i, j, dy;
+
+  if (!psplash_clip_rect(canvas, &sx, &sy, &w, &h))
+    return TRUE;
+
+  if (!psplash_decode_image_unrotated(canvas, img_width, img_height,
+				      img_bytes_per_pixel, img_rowstride,
+				      rle_data, &pixels, &alpha))
+    return FALSE;
+
+  off = (sy - y) * img_width + (sx - x);
+  psplash_put_block(canvas, sx, sy, w, h, pixels + off, img_width,
+		    alpha + off, img_width);
+
+  for (dy = 0; dy < h; dy++)
+    {
+      a = alpha + off + dy * img_width;
+
+      for (i = 0; i < w; i = j)
+	{
+	  if (a[i] == 0 || a[i] == 255)
+	    {
+	      j = i + 1;
+	      continue;
+	    }
+
+	  for (j = i; j < w && j - i < BLEND_CHUNK && a[j] && a[j] != 255; j++)
+	    src[j - i] = canvas->unpack(canvas, pixels[off + dy * img_width + j]);
+	  psplash_blend_span(canvas, sx + i, sy + dy, j - i, src, a + i);
+	}
+    }
 
-  for (dy=0; dy < height; dy++)
-    for (dx=0; dx < width; dx++)
-	psplash_plot_pixel(canvas, x+dx, y+dy, red, green, blue);
+  free(pixels);
+  free(alpha);
+  return TRUE;
 }
 
 void
@@ -145,151 +1205,673 @@ psplash_draw_image(PSplashCanvas *canvas,
 		   int            img_rowstride,
 		   uint8         *rle_data)
 {
-  uint8       *p = rle_data;
-  int          dx = 0, dy = 0,  total_len;
-  unsigned int len;
+  psplash_canvas_damage(canvas, x, y, img_width, img_height);
+
+  if ((canvas->angle == 90 || canvas->angle == 270)
+      && psplash_draw_image_rotated(canvas, x, y, img_width, img_height,
+				    img_bytes_per_pixel, img_rowstride,
+				    rle_data))
+    return;
+
+  psplash_decode_image(canvas, NULL, x, y, img_width, img_height,
+		       img_bytes_per_pixel, img_rowstride, rle_data);
+}
+
+PSplashImage *
+psplash_image_new(PSplashCanvas *canvas,
+		  int            img_width,
+		  int            img_height,
+		  int            img_bytes_per_pixel,
+		  int            img_rowstride,
+		  uint8         *rle_data)
+{
+  PSplashImage  *image;
+  PSplashCanvas  ic, ac;
+  int            px, py, pw, ph, i;
+
+  if (canvas->fill_span == psplash_fill_span_none)
+    return NULL;
+
+  if ((image = calloc(1, sizeof(PSplashImage))) == NULL)
+    goto fail;
+
+  psplash_map_rect(canvas->angle, img_width, img_height,
+		   0, 0, img_width, img_height, &px, &py, &pw, &ph);
+
+  image->width  = img_width;
+  image->height = img_height;
+  image->stride = pw * (canvas->bpp >> 3);
+  image->data   = calloc(ph, image->stride);
+  image->alpha  = calloc(ph, pw);
+
+  if (image->data == NULL || image->alpha == NULL)
+    goto fail;
+
+  /* Decode the image through the canvas' own span writers into a buffer
+   * laid out like the canvas, and its alpha into a matching 8 bpp one */
+  ic        = *canvas;
+  ic.width  = img_width;
+  ic.height = img_height;
+  ic.stride = image->stride;
+  ic.data   = image->data;
+  psplash_canvas_set_clip(&ic, 0, 0, img_width, img_height);
+
+  ac           = ic;
+  ac.bpp       = 8;
+  ac.stride    = pw;
+  ac.data      = (char *) image->alpha;
+  ac.fill_span = fill_span_table[0][psplash_angle_index(canvas->angle)];
+  ac.put_span  = put_span_table[0][psplash_angle_index(canvas->angle)];
 
-  total_len = img_rowstride * img_height;
+  psplash_decode_image(&ic, &ac, 0, 0, img_width, img_height,
+		       img_bytes_per_pixel, img_rowstride, rle_data);
 
-  /* FIXME: Optimise, check for over runs ... */
-  while ((p - rle_data) < total_len)
+  /* Opaque images don't need the alpha, they are drawn with plain copies */
+  for (i = 0; i < pw * ph && image->alpha[i] == 255; i++)
+    ;
+  if (i == pw * ph)
     {
-      len = *(p++);
+      free(image->alpha);
+      image->alpha = NULL;
+    }
 
-      if (len & 128)
-	{
-	  len -= 128;
+  return image;
 
-	  if (len == 0) break;
+ fail:
+  perror("Error no memory");
+  psplash_image_free(image);
+  return NULL;
+}
 
-	  do
-	    {
-	      if ((img_bytes_per_pixel < 4 || *(p+3)) && dx < img_width)
-	        psplash_plot_pixel(canvas, x+dx, y+dy, *(p), *(p+1), *(p+2));
-	      if (++dx * img_bytes_per_pixel >= img_rowstride) { dx=0; dy++; }
-	    }
-	  while (--len);
+void
+psplash_image_free(PSplashImage *image)
+{
+  if (!image)
+    return;
 
-	  p += img_bytes_per_pixel;
-	}
+  free(image->data);
+  free(image->alpha);
+  free(image);
+}
+
+/* Blend a run of len cached pixels with their alphas over a run of canvas
+ * buffer pixels, both in buffer order */
+static void
+psplash_blend_row(PSplashCanvas *canvas,
+		  char          *dst,
+		  char          *src,
+		  const uint8   *alpha,
+		  int            len)
+{
+  void        (*get_span)(PSplashCanvas *, int, int, int, uint32_t *);
+  void        (*put_span)(PSplashCanvas *, int, int, int, const uint32_t *);
+  PSplashCanvas rc = *canvas;
+  uint32_t      pixels[BLEND_CHUNK], rgb[BLEND_CHUNK];
+  int           depth = psplash_depth_index(canvas->bpp), i, n;
+
+  get_span = get_span_table[depth][0];
+  put_span = put_span_table[depth][0];
+
+  for (; len > 0; len -= n, alpha += n)
+    {
+      n = MIN(len, BLEND_CHUNK);
+
+      rc.data = src;
+      get_span(&rc, 0, 0, n, rgb);
+      for (i = 0; i < n; i++)
+	rgb[i] = canvas->unpack(canvas, rgb[i]);
+
+      rc.data = dst;
+      get_span(&rc, 0, 0, n, pixels);
+      psplash_blend(canvas, pixels, rgb, alpha, n);
+      put_span(&rc, 0, 0, n, pixels);
+
+      src += n * (canvas->bpp >> 3);
+      dst += n * (canvas->bpp >> 3);
+    }
+}
+
+void
+psplash_image_draw(PSplashCanvas *canvas,
+		   PSplashImage  *image,
+		   int            x,
+		   int            y)
+{
+  int    sx, sy, w, h, px, py, pw, ph, ix, iy, dy, i, start;
+  int    bytespp = canvas->bpp >> 3;
+  char  *dst, *src;
+  uint8 *alpha = NULL;
+
+  if (!image)
+    return;
+
+  sx = x;
+  sy = y;
+  w  = image->width;
+  h  = image->height;
+
+  if (!psplash_clip_rect(canvas, &sx, &sy, &w, &h))
+    return;
+
+  /* The visible part lies at the same orientation in the canvas buffer and
+   * in the cached image, so rows of one map to rows of the other */
+  psplash_map_rect(canvas->angle, canvas->width, canvas->height,
+		   sx, sy, w, h, &px, &py, &pw, &ph);
+  psplash_add_damage(canvas, px, py, pw, ph);
+  psplash_map_rect(canvas->angle, image->width, image->height,
+		   sx - x, sy - y, w, h, &ix, &iy, &pw, &ph);
+
+  dst = canvas->data + OFFSET (canvas, px, py);
+  src = image->data + iy * image->stride + ix * bytespp;
+  if (image->alpha)
+    alpha = image->alpha + iy * (image->stride / bytespp) + ix;
+
+  for (dy = 0; dy < ph; dy++)
+    {
+      if (!alpha)
+	memcpy(dst, src, pw * bytespp);
       else
 	{
-	  if (len == 0) break;
-
-	  do
+	  /* Copy runs of opaque pixels, blend runs of translucent ones */
+	  for (i = 0; i < pw; )
 	    {
-	      if ((img_bytes_per_pixel < 4 || *(p+3)) && dx < img_width)
-	        psplash_plot_pixel(canvas, x+dx, y+dy, *(p), *(p+1), *(p+2));
-	      if (++dx * img_bytes_per_pixel >= img_rowstride) { dx=0; dy++; }
-	      p += img_bytes_per_pixel;
+	      while (i < pw && !alpha[i])
+		i++;
+	      for (start = i; i < pw && alpha[i] == 255; i++)
+		;
+	      if (i > start)
+		memcpy(dst + start * bytespp, src + start * bytespp,
+		       (i - start) * bytespp);
+	      for (start = i; i < pw && alpha[i] && alpha[i] != 255; i++)
+		;
+	      if (i > start)
+		psplash_blend_row(canvas, dst + start * bytespp,
+				  src + start * bytespp, alpha + start,
+				  i - start);
 	    }
-	  while (--len && (p - rle_data) < total_len);
+	  alpha += image->stride / bytespp;
 	}
+
+      dst += canvas->stride;
+      src += image->stride;
     }
 }
 
 /* Font rendering code based on BOGL by Ben Pfaff */
 
+/* Find the index entry of a character by walking its hash chain once.
+ * Returns -1 if the font has no glyph for it. */
 static int
-psplash_font_glyph (const PSplashFont *font, wchar_t wc, u_int32_t **bitmap)
+psplash_font_find (const PSplashFont *font, wchar_t wc)
 {
   int mask = font->index_mask;
   int i;
 
-  for (;;)
+  if (wc < 0)
+    return -1;
+
+  for (i = font->offset[wc & mask]; font->index[i]; i += 2)
+    if ((wchar_t)(font->index[i] & ~mask) == (wc & ~mask))
+      return i;
+
+  return -1;
+}
+
+/* Glyph lookup table, built once from the font's hash index so every
+ * character is found in constant time. Latin-1 is indexed directly, other
+ * characters are kept sorted and bisected. Characters missing from the
+ * font map to a replacement glyph. */
+typedef struct PSplashGlyphEntry
+{
+  wchar_t wc;
+  int     entry;
+}
+PSplashGlyphEntry;
+
+typedef struct PSplashGlyphTable
+{
+  const PSplashFont *font;
+  int                latin1[256];
+  PSplashGlyphEntry *wide;
+  int                n_wide;
+  int                replacement;
+}
+PSplashGlyphTable;
+
+static PSplashGlyphTable glyph_table;
+
+static int
+psplash_glyph_entry_cmp (const void *a, const void *b)
+{
+  const PSplashGlyphEntry *ea = a, *eb = b;
+
+  return (ea->wc > eb->wc) - (ea->wc < eb->wc);
+}
+
+static void
+psplash_glyph_table_build (PSplashGlyphTable *table, const PSplashFont *font)
+{
+  int mask = font->index_mask;
+  int bucket, i, n;
+
+  free (table->wide);
+  table->font   = font;
+  table->wide   = NULL;
+  table->n_wide = 0;
+
+  for (i = 0; i < 256; i++)
+    table->latin1[i] = psplash_font_find (font, i);
+
+  /* Collect every glyph outside Latin-1 from the hash chains */
+  for (n = 0, bucket = 0; bucket <= mask; bucket++)
+    for (i = font->offset[bucket]; font->index[i]; i += 2)
+      if (((font->index[i] & ~mask) | bucket) > 0xff)
+	n++;
+
+  if (n && (table->wide = malloc (n * sizeof (PSplashGlyphEntry))) != NULL)
     {
-      for (i = font->offset[wc & mask]; font->index[i]; i += 2)
-	{
-	  if ((wchar_t)(font->index[i] & ~mask) == (wc & ~mask))
+      for (bucket = 0; bucket <= mask; bucket++)
+	for (i = font->offset[bucket]; font->index[i]; i += 2)
+	  if (((font->index[i] & ~mask) | bucket) > 0xff)
 	    {
-	      if (bitmap != NULL)
-		*bitmap = &font->content[font->index[i+1]];
-	      return font->index[i] & mask;
+	      table->wide[table->n_wide].wc = (font->index[i] & ~mask) | bucket;
+	      table->wide[table->n_wide].entry = i;
+	      table->n_wide++;
 	    }
+
+      qsort (table->wide, table->n_wide, sizeof (PSplashGlyphEntry),
+	     psplash_glyph_entry_cmp);
+    }
+
+  /* U+FFFD REPLACEMENT CHARACTER if the font has it, else '?' */
+  table->replacement = psplash_font_find (font, 0xfffd);
+  if (table->replacement < 0)
+    table->replacement = table->latin1['?'];
+}
+
+/* Look up the glyph for a character, returning its width and, if bitmap
+ * isn't NULL, its rows. Characters the font lacks get the replacement
+ * glyph, or a width of 0 and no bitmap if there is none. */
+static int
+psplash_font_glyph (const PSplashFont *font, wchar_t wc, u_int32_t **bitmap)
+{
+  PSplashGlyphTable *table = &glyph_table;
+  PSplashGlyphEntry  key, *found;
+  int                entry = -1;
+
+  if (table->font != font)
+    psplash_glyph_table_build (table, font);
+
+  if (wc >= 0 && wc <= 0xff)
+    entry = table->latin1[wc];
+  else if (table->wide)
+    {
+      key.wc = wc;
+      found = bsearch (&key, table->wide, table->n_wide,
+		       sizeof (PSplashGlyphEntry), psplash_glyph_entry_cmp);
+      if (found)
+	entry = found->entry;
+    }
+  else if (table->n_wide == 0)
+    /* The sorted table couldn't be allocated, or is empty */
+    entry = psplash_font_find (font, wc);
+
+  if (entry < 0)
+    entry = table->replacement;
+
+  if (entry < 0)
+    {
+      if (bitmap != NULL)
+	*bitmap = NULL;
+      return 0;
+    }
+
+  if (bitmap != NULL)
+    *bitmap = &font->content[font->index[entry+1]];
+  return font->index[entry] & font->index_mask;
+}
+
+/* Draw a glyph, clipped once, writing each run of set bits in a row as one
+ * span. Runs are found by counting leading zero and one bits. */
+static void
+psplash_draw_glyph(PSplashCanvas *canvas,
+		   int            x,
+		   int            y,
+		   int            w,
+		   int            h,
+		   u_int32_t     *glyph,
+		   uint32_t       pixel)
+{
+  int       sx = x, sy = y, sw = w, sh = h, cx, lead, run;
+  u_int32_t g, visible;
+
+  if (w <= 0 || !psplash_clip_rect(canvas, &sx, &sy, &sw, &sh))
+    return;
+
+  /* Bits of the columns left after clipping, counted from the top bit */
+  visible = sw == 32 ? 0xffffffff : ~(0xffffffff >> sw);
+  glyph += sy - y;
+
+  for (; sh--; sy++)
+    {
+      g = (*glyph++ << (sx - x)) & visible;
+
+      for (cx = 0; g; cx += run)
+	{
+	  lead = __builtin_clz(g);
+	  g <<= lead;
+	  cx += lead;
+	  run = ~g ? __builtin_clz(~g) : 32;
+	  canvas->fill_span(canvas, sx + cx, sy, run, pixel);
+	  g = run == 32 ? 0 : g << run;
 	}
     }
-  return 0;
 }
 
-void
-psplash_text_size(int                *width,
-		  int                *height,
-		  const PSplashFont  *font,
-		  const char         *text)
+/* Mask bytes for each value of 8 glyph bits, first bit first */
+static uint8 glyph_expand[256][8];
+
+/* Draw a glyph on a 90 or 270 degree canvas through psplash_put_block(),
+ * expanding its bitmap into a mask BLOCK_TILE rows at a time */
+static void
+psplash_draw_glyph_rotated(PSplashCanvas *canvas,
+			   int            x,
+			   int            y,
+			   int            w,
+			   int            h,
+			   u_int32_t     *glyph,
+			   uint32_t       pixel)
 {
-  char   *c = (char*)text;
-  wchar_t wc;
-  int     k, n, w, h, mw;
+  uint8 mask[BLOCK_TILE * 32];
+  int   cx, cy, sx, sy, sw, sh, i;
+
+  if (!glyph_expand[255][7])
+    for (i = 0; i < 256; i++)
+      for (cx = 0; cx < 8; cx++)
+	glyph_expand[i][cx] = (i << cx) & 0x80 ? 0xff : 0;
+
+  for (cy = 0; cy < h; cy += BLOCK_TILE, glyph += BLOCK_TILE)
+    {
+      for (i = 0; i < BLOCK_TILE && cy + i < h; i++)
+	for (cx = 0; cx < w; cx += 8)
+	  memcpy(mask + i * 32 + cx, glyph_expand[(glyph[i] >> (24 - cx)) & 0xff], 8);
+
+      sx = x;
+      sy = y + cy;
+      sw = w;
+      sh = i;
+
+      if (psplash_clip_rect(canvas, &sx, &sy, &sw, &sh))
+	psplash_put_block(canvas, sx, sy, sw, sh, &pixel, 0,
+			  mask + (sy - y - cy) * 32 + (sx - x), 32);
+    }
+}
+
+/* Cache of glyphs already drawn in a canvas' pixel format, color and
+ * rotation, so repeated text is drawn with the masked row copies of
+ * psplash_image_draw(). Entries live in a fixed arena, GLYPH_CACHE_WAYS to
+ * a set, and the least recently used one in a set is replaced. */
+#define GLYPH_CACHE_SETS   16
+#define GLYPH_CACHE_WAYS   4
+#define GLYPH_CACHE_PIXELS 256	/* Largest glyph cached, 16x16 or 8x32 */
+
+typedef struct PSplashGlyphCacheEntry
+{
+  const PSplashFont *font;
+  wchar_t            wc;
+  uint32_t           pixel;
+  int                angle, bpp;
+  unsigned int       last_used;
+  PSplashImage       image;
+}
+PSplashGlyphCacheEntry;
+
+static PSplashGlyphCacheEntry
+glyph_cache[GLYPH_CACHE_SETS][GLYPH_CACHE_WAYS];
+static char  glyph_cache_data[GLYPH_CACHE_SETS][GLYPH_CACHE_WAYS]
+			     [GLYPH_CACHE_PIXELS * 4];
+static uint8 glyph_cache_alpha[GLYPH_CACHE_SETS][GLYPH_CACHE_WAYS]
+			      [GLYPH_CACHE_PIXELS];
+static unsigned int glyph_cache_clock;
+
+/* Find a glyph in the cache, drawing it into the least recently used entry
+ * of its set on a miss. Returns NULL for glyphs too large to cache. */
+static PSplashImage *
+psplash_glyph_cache_get(PSplashCanvas     *canvas,
+			const PSplashFont *font,
+			wchar_t            wc,
+			int                w,
+			int                h,
+			u_int32_t         *glyph,
+			uint32_t           pixel)
+{
+  PSplashGlyphCacheEntry *set, *entry;
+  PSplashCanvas           ic, ac;
+  int                     s, i, px, py, pw, ph;
 
-  n = strlen (text);
-  mw = h = w = 0;
+  if (w <= 0 || w * h > GLYPH_CACHE_PIXELS
+      || canvas->fill_span == psplash_fill_span_none)
+    return NULL;
 
-  mbtowc (0, 0, 0);
-  for (; (k = mbtowc (&wc, c, n)) > 0; c += k, n -= k)
+  s = (wc ^ (wc >> 4) ^ pixel) & (GLYPH_CACHE_SETS - 1);
+  set = glyph_cache[s];
+  entry = &set[0];
+
+  for (i = 0; i < GLYPH_CACHE_WAYS; i++)
     {
-      if (*c == '\n')
+      if (set[i].font == font && set[i].wc == wc && set[i].pixel == pixel
+	  && set[i].angle == canvas->angle && set[i].bpp == canvas->bpp)
 	{
-	  if (w > mw)
-	    mw = w;
-	  w = 0;
-	  h += font->height;
-	  continue;
+	  set[i].last_used = ++glyph_cache_clock;
+	  return &set[i].image;
 	}
 
-      w += psplash_font_glyph (font, wc, NULL);
+      if (set[i].last_used < entry->last_used)
+	entry = &set[i];
     }
 
-  *width  = (w > mw) ? w : mw;
-  *height = (h == 0) ? font->height : h;
+  psplash_map_rect(canvas->angle, w, h, 0, 0, w, h, &px, &py, &pw, &ph);
+
+  entry->font      = font;
+  entry->wc        = wc;
+  entry->pixel     = pixel;
+  entry->angle     = canvas->angle;
+  entry->bpp       = canvas->bpp;
+  entry->last_used = ++glyph_cache_clock;
+
+  entry->image.width  = w;
+  entry->image.height = h;
+  entry->image.stride = pw * (canvas->bpp >> 3);
+  entry->image.data   = glyph_cache_data[s][entry - set];
+  entry->image.alpha  = glyph_cache_alpha[s][entry - set];
+
+  /* Draw the glyph into the entry as if it were a canvas of its own size,
+   * and its bits into the alpha as 0xff */
+  ic        = *canvas;
+  ic.width  = w;
+  ic.height = h;
+  ic.stride = entry->image.stride;
+  ic.data   = entry->image.data;
+  psplash_canvas_set_clip(&ic, 0, 0, w, h);
+
+  ac           = ic;
+  ac.bpp       = 8;
+  ac.stride    = pw;
+  ac.data      = (char *) entry->image.alpha;
+  ac.fill_span = fill_span_table[0][psplash_angle_index(canvas->angle)];
+
+  memset(entry->image.alpha, 0, w * h);
+  psplash_draw_glyph(&ic, 0, 0, w, h, glyph, pixel);
+  psplash_draw_glyph(&ac, 0, 0, w, h, glyph, 0xff);
+
+  return &entry->image;
 }
 
-void
-psplash_draw_text(PSplashCanvas     *canvas,
-		  int                x,
-		  int                y,
-		  uint8              red,
-		  uint8              green,
-		  uint8              blue,
-		  const PSplashFont *font,
-		  const char        *text)
+/* Decode the UTF-8 character at *text and move past it. Malformed,
+ * overlong and surrogate sequences decode to U+FFFD one byte at a time. */
+static wchar_t
+psplash_utf8_next(const char **text)
 {
-  int     h, w, k, n, cx, cy, dx, dy;
-  char   *c = (char*)text;
-  wchar_t wc;
+  const uint8 *p = (const uint8 *) *text;
+  wchar_t      wc, min;
+  int          n, i;
+
+  if (p[0] < 0x80)
+    n = 0, wc = p[0], min = 0;
+  else if ((p[0] & 0xe0) == 0xc0)
+    n = 1, wc = p[0] & 0x1f, min = 0x80;
+  else if ((p[0] & 0xf0) == 0xe0)
+    n = 2, wc = p[0] & 0x0f, min = 0x800;
+  else if ((p[0] & 0xf8) == 0xf0)
+    n = 3, wc = p[0] & 0x07, min = 0x10000;
+  else
+    goto invalid;
+
+  for (i = 1; i <= n; i++)
+    {
+      if ((p[i] & 0xc0) != 0x80)
+	goto invalid;
+      wc = (wc << 6) | (p[i] & 0x3f);
+    }
+
+  if (wc < min || wc > 0x10ffff || (wc >= 0xd800 && wc <= 0xdfff))
+    goto invalid;
+
+  *text += n + 1;
+  return wc;
+
+ invalid:
+  *text += 1;
+  return 0xfffd;
+}
+
+PSplashTextLayout *
+psplash_text_layout_new(const PSplashFont *font,
+			const char        *text)
+{
+  PSplashTextLayout *layout;
+  PSplashTextGlyph  *g;
+  wchar_t            wc;
+  int                x = 0, y = 0;
 
-  n = strlen (text);
-  h = font->height;
-  dx = dy = 0;
+  /* A character takes at least a byte, so strlen() bounds the glyphs */
+  layout = malloc(sizeof(PSplashTextLayout)
+		  + strlen(text) * sizeof(PSplashTextGlyph));
+  if (layout == NULL)
+    {
+      perror("Error no memory");
+      return NULL;
+    }
 
-  mbtowc (0, 0, 0);
-  for (; (k = mbtowc (&wc, c, n)) > 0; c += k, n -= k)
+  layout->font     = font;
+  layout->width    = 0;
+  layout->n_glyphs = 0;
+  layout->glyphs   = (PSplashTextGlyph *) (layout + 1);
+
+  while (*text)
     {
-      u_int32_t *glyph = NULL;
+      wc = psplash_utf8_next(&text);
 
-      if (*c == '\n')
+      if (wc == '\n')
 	{
-	  dy += h;
-	  dx  = 0;
+	  y += font->height;
+	  x  = 0;
 	  continue;
 	}
 
-      w = psplash_font_glyph (font, wc, &glyph);
+      g = &layout->glyphs[layout->n_glyphs];
+      g->width = psplash_font_glyph (font, wc, &g->bitmap);
 
-      if (glyph == NULL)
+      if (g->bitmap == NULL)
 	continue;
 
-      for (cy = 0; cy < h; cy++)
-	{
-	  u_int32_t g = *glyph++;
+      g->x  = x;
+      g->y  = y;
+      g->wc = wc;
+      layout->n_glyphs++;
 
-	  for (cx = 0; cx < w; cx++)
-	    {
-	      if (g & 0x80000000)
-		psplash_plot_pixel(canvas, x+dx+cx, y+dy+cy, red, green, blue);
-	      g <<= 1;
-	    }
-	}
+      x += g->width;
+      if (x > layout->width)
+	layout->width = x;
+    }
+
+  layout->height = y + font->height;
+
+  return layout;
+}
+
+void
+psplash_text_layout_free(PSplashTextLayout *layout)
+{
+  free(layout);
+}
+
+void
+psplash_text_layout_draw(PSplashCanvas     *canvas,
+			 PSplashTextLayout *layout,
+			 int                x,
+			 int                y,
+			 uint8              red,
+			 uint8              green,
+			 uint8              blue)
+{
+  PSplashTextGlyph *g;
+  PSplashImage     *cached;
+  uint32_t          pixel;
+  int               h, i;
+  int               rotated = (canvas->angle == 90 || canvas->angle == 270);
+
+  if (!layout)
+    return;
+
+  pixel = canvas->pack(canvas, red, green, blue);
+  h = layout->font->height;
+
+  psplash_canvas_damage(canvas, x, y, layout->width, layout->height);
+
+  for (i = 0; i < layout->n_glyphs; i++)
+    {
+      g = &layout->glyphs[i];
 
-      dx += w;
+      if ((cached = psplash_glyph_cache_get(canvas, layout->font, g->wc,
+					    g->width, h, g->bitmap,
+					    pixel)) != NULL)
+	psplash_image_draw(canvas, cached, x + g->x, y + g->y);
+      else if (rotated)
+	psplash_draw_glyph_rotated(canvas, x + g->x, y + g->y, g->width, h,
+				   g->bitmap, pixel);
+      else
+	psplash_draw_glyph(canvas, x + g->x, y + g->y, g->width, h,
+			   g->bitmap, pixel);
     }
 }
+
+void
+psplash_text_size(int                *width,
+		  int                *height,
+		  const PSplashFont  *font,
+		  const char         *text)
+{
+  PSplashTextLayout *layout = psplash_text_layout_new(font, text);
+
+  *width  = layout ? layout->width : 0;
+  *height = layout ? layout->height : font->height;
+
+  psplash_text_layout_free(layout);
+}
+
+void
+psplash_draw_text(PSplashCanvas     *canvas,
+		  int                x,
+		  int                y,
+		  uint8              red,
+		  uint8              green,
+		  uint8              blue,
+		  const PSplashFont *font,
+		  const char        *text)
+{
+  PSplashTextLayout *layout = psplash_text_layout_new(font, text);
+
+  psplash_text_layout_draw(canvas, layout, x, y, red, green, blue);
+  psplash_text_layout_free(layout);
+}
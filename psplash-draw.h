@@ -20,6 +20,17 @@ enum RGBMode {
     GENERIC,
 };
 
+/* Maximum number of separate damaged rectangles a canvas tracks, more are
+ * merged into them */
+#define PSPLASH_MAX_DAMAGE 8
+
+typedef struct PSplashRect
+{
+  int            x, y;
+  int            width, height;
+}
+PSplashRect;
+
 typedef struct PSplashCanvas
 {
   int            width, height;
@@ -39,9 +50,117 @@ typedef struct PSplashCanvas
 
   void          *priv;
   void (*flip)(struct PSplashCanvas *canvas, int sync);
+
+  /* Backends that present asynchronously set event_fd to a descriptor the
+   * main loop watches, and handle_events to process what arrives on it.
+   * With wait set, handle_events blocks until the buffer being drawn is no
+   * longer in use by a pending flip. event_fd is -1 otherwise. */
+  int            event_fd;
+  void (*handle_events)(struct PSplashCanvas *canvas, int wait);
+
+  /* Set along with handle_events, returns nonzero while a flip is still
+   * pending, without waiting for it, so the main loop can hold off drawing
+   * until event_fd reports it done */
+  int (*flip_pending)(struct PSplashCanvas *canvas);
+
+  /* Backends that can show a rectangle of the screen on a plane of its own
+   * set new_layer. It returns a canvas of the same geometry, starting out
+   * with this one's content, of which only the rectangle is shown above
+   * this canvas. Updates then only touch and flip the layer. It returns
+   * NULL if no plane can be used. */
+  struct PSplashCanvas *(*new_layer)(struct PSplashCanvas *canvas,
+				     int x, int y, int width, int height);
+
+  /* Further canvases showing the same splash on other displays, in the same
+   * format and angle but possibly another size. NULL for the last one. */
+  struct PSplashCanvas *next;
+
+  /* Span writers, selected by psplash_canvas_setup() once the format and
+   * angle are known. pack converts a color to the native pixel value and
+   * unpack converts one back to 0xRRGGBB. fill_span writes len copies of a
+   * pixel along a canvas row, starting at x,y, put_span writes len already
+   * packed pixels and get_span reads them back. The span writers do no
+   * clipping. */
+  uint32_t (*pack)(struct PSplashCanvas *canvas,
+		   uint8 red, uint8 green, uint8 blue);
+  uint32_t (*unpack)(struct PSplashCanvas *canvas, uint32_t pixel);
+  void (*fill_span)(struct PSplashCanvas *canvas,
+		    int x, int y, int len, uint32_t pixel);
+  void (*put_span)(struct PSplashCanvas *canvas,
+		   int x, int y, int len, const uint32_t *pixels);
+  void (*get_span)(struct PSplashCanvas *canvas,
+		   int x, int y, int len, uint32_t *pixels);
+
+  /* Drawing is clipped to this rectangle of the canvas, all of it unless
+   * narrowed with psplash_canvas_set_clip() */
+  PSplashRect    clip;
+
+  /* Areas drawn since the last flip, in unrotated buffer coordinates, so
+   * a flip can bring the other buffer up to date by copying just those */
+  PSplashRect    damage[PSPLASH_MAX_DAMAGE];
+  int            n_damage;
 }
 PSplashCanvas;
 
+/* An image converted to the native format, stride and rotation of a
+ * canvas, so it can be drawn with plain row copies. alpha holds the alpha
+ * of every pixel in the same layout, and is NULL if all are opaque. */
+typedef struct PSplashImage
+{
+  int            width, height;
+  int            stride;
+  char          *data;
+  uint8         *alpha;
+}
+PSplashImage;
+
+/* A glyph of a laid out text, at x,y from the text's top left corner */
+typedef struct PSplashTextGlyph
+{
+  int            x, y;
+  int            width;
+  wchar_t        wc;
+  u_int32_t     *bitmap;
+}
+PSplashTextGlyph;
+
+/* A text decoded and laid out once, so it can be measured, cleared and
+ * drawn without decoding it again */
+typedef struct PSplashTextLayout
+{
+  const PSplashFont *font;
+  int                width, height;
+  int                n_glyphs;
+  PSplashTextGlyph  *glyphs;
+}
+PSplashTextLayout;
+
+void
+psplash_canvas_setup(PSplashCanvas *canvas);
+
+void
+psplash_canvas_set_clip(PSplashCanvas *canvas,
+			int            x,
+			int            y,
+			int            width,
+			int            height);
+
+void
+psplash_canvas_map_rect(PSplashCanvas *canvas,
+			PSplashRect   *rect);
+
+void
+psplash_canvas_damage(PSplashCanvas *canvas,
+		      int            x,
+		      int            y,
+		      int            width,
+		      int            height);
+
+void
+psplash_canvas_sync_damage(PSplashCanvas *canvas,
+			   char          *dst,
+			   const char    *src);
+
 void
 psplash_draw_rect(PSplashCanvas *canvas,
 		  int            x,
@@ -62,6 +181,39 @@ psplash_draw_image(PSplashCanvas *canvas,
 		   int            img_rowstride,
 		   uint8         *rle_data);
 
+PSplashImage *
+psplash_image_new(PSplashCanvas *canvas,
+		  int            img_width,
+		  int            img_height,
+		  int            img_bytes_per_pixel,
+		  int            img_rowstride,
+		  uint8         *rle_data);
+
+void
+psplash_image_free(PSplashImage *image);
+
+void
+psplash_image_draw(PSplashCanvas *canvas,
+		   PSplashImage  *image,
+		   int            x,
+		   int            y);
+
+PSplashTextLayout *
+psplash_text_layout_new(const PSplashFont *font,
+			const char        *text);
+
+void
+psplash_text_layout_free(PSplashTextLayout *layout);
+
+void
+psplash_text_layout_draw(PSplashCanvas     *canvas,
+			 PSplashTextLayout *layout,
+			 int                x,
+			 int                y,
+			 uint8              red,
+			 uint8              green,
+			 uint8              blue);
+
 void
 psplash_text_size(int                *width,
 		  int                *height,
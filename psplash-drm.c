@@ -33,9 +33,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
 #include <sys/mman.h>
 #include <time.h>
 #include <unistd.h>
+#include <drm_fourcc.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 #include "psplash-drm.h"
@@ -43,8 +45,6 @@
 #include "psplash-drm-lease.h"
 #endif
 
-#define MIN(a,b) ((a) < (b) ? (a) : (b))
-
 struct modeset_buf;
 struct modeset_dev;
 static int modeset_find_crtc(int fd, drmModeRes *res, drmModeConnector *conn,
@@ -55,6 +55,9 @@ static int modeset_setup_dev(int fd, drmModeRes *res, drmModeConnector *conn,
 			     struct modeset_dev *dev);
 static int modeset_open(int *out, const char *node);
 static int modeset_prepare(int fd);
+static int modeset_choose_format(int fd, uint32_t crtc);
+static uint32_t modeset_find_plane(int fd, uint32_t crtc, uint64_t type,
+				   uint32_t format);
 
 #ifdef ENABLE_DRM_LEASE
 char *drm_lease_name;
@@ -105,6 +108,9 @@ static int modeset_open(int *out, const char *node)
 		return -EOPNOTSUPP;
 	}
 
+	/* list primary planes too, to learn which formats they scan out */
+	drmSetClientCap(fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
+
 	*out = fd;
 	return 0;
 }
@@ -189,6 +195,22 @@ struct modeset_dev {
 	uint32_t width;
 	uint32_t height;
 
+	/*
+	 * Connectors running the same resolution as an earlier one scan out
+	 * that device's buffers instead of having their own, so the splash is
+	 * only drawn once per resolution. shared points to the device owning
+	 * the buffers, or is NULL for owners, which have a canvas to draw
+	 * into them and count the flips still pending on all their CRTCs.
+	 * flip_seq tags the events of the flip in flight, see
+	 * modeset_page_flip_event().
+	 */
+	struct modeset_dev *shared;
+	PSplashCanvas *canvas;
+	int flip_pending;
+	unsigned int flip_seq;
+	long long flip_queued;
+	int sync_pending;
+
 	unsigned int front_buf;
 	struct modeset_buf bufs[2];
 
@@ -196,10 +218,88 @@ struct modeset_dev {
 	uint32_t conn;
 	uint32_t crtc;
 	drmModeCrtc *saved_crtc;
+	int keep_mode;
+	int shown;
+	int kept;
 };
 
 static struct modeset_dev *modeset_list = NULL;
 
+/*
+ * Pixel formats our dumb buffers can be created in, with the matching canvas
+ * layout. The first device picks the one to use from what its primary plane
+ * can scan out, preferring formats of modeset_bpp bits per pixel. All other
+ * devices and planes use the same format, so one set of converted images
+ * draws on every canvas.
+ */
+struct modeset_format {
+	uint32_t fourcc;
+	int bpp;
+	enum RGBMode rgbmode;
+};
+
+static const struct modeset_format modeset_formats[] = {
+	{ DRM_FORMAT_XRGB8888, 32, RGB888 },
+	{ DRM_FORMAT_XBGR8888, 32, BGR888 },
+	{ DRM_FORMAT_RGB565, 16, RGB565 },
+	{ DRM_FORMAT_BGR565, 16, BGR565 },
+};
+
+#define MODESET_FORMAT_COUNT \
+	(sizeof(modeset_formats) / sizeof(modeset_formats[0]))
+
+static const struct modeset_format *modeset_format = NULL;
+static int modeset_bpp = 32;
+
+/* Keep the mode the bootloader set where possible */
+static int modeset_takeover = 0;
+
+/* Draw straight into a single scanned out buffer, see psplash_drm_flip_single() */
+static int modeset_single = 0;
+
+enum {
+	PLANE_FB_ID,
+	PLANE_CRTC_ID,
+	PLANE_SRC_X,
+	PLANE_SRC_Y,
+	PLANE_SRC_W,
+	PLANE_SRC_H,
+	PLANE_CRTC_X,
+	PLANE_CRTC_Y,
+	PLANE_CRTC_W,
+	PLANE_CRTC_H,
+	PLANE_PROP_COUNT
+};
+
+static const char * const modeset_plane_prop_names[PLANE_PROP_COUNT] = {
+	"FB_ID", "CRTC_ID", "SRC_X", "SRC_Y", "SRC_W", "SRC_H",
+	"CRTC_X", "CRTC_Y", "CRTC_W", "CRTC_H",
+};
+
+/* An overlay plane showing part of the screen, see psplash_drm_new_layer() */
+struct modeset_layer {
+	PSplashCanvas canvas;
+	uint32_t plane;
+	uint32_t props[PLANE_PROP_COUNT];
+	PSplashRect rect;
+	unsigned int front_buf;
+	struct modeset_buf bufs[2];
+	int flip_pending;
+	unsigned int flip_seq;
+	long long flip_queued;
+};
+
+static struct modeset_layer *modeset_layer = NULL;
+
+/* Where the layer canvas addresses layer buffer i. The buffers only hold the
+ * layer's rectangle, see psplash_drm_new_layer(). */
+static char *modeset_layer_data(struct modeset_layer *layer, int i)
+{
+	return (char *)layer->bufs[i].map -
+	       layer->rect.y * (int)layer->bufs[i].stride -
+	       layer->rect.x * (modeset_format->bpp >> 3);
+}
+
 /*
  * So as next step we need to actually prepare all connectors that we find. We
  * do this in this little helper function:
@@ -235,10 +335,8 @@ static int modeset_prepare(int fd)
 		return -errno;
 	}
 
-	/* ~iterate all connectors~ - Use first connector if present. It is
-	   optimization related workaround since psplash supports drawing splash
-	   screen on one scanout anyway. */
-	for (i = 0; i < MIN(res->count_connectors, 1); ++i) {
+	/* iterate all connectors */
+	for (i = 0; i < res->count_connectors; ++i) {
 		/* get information for each connector */
 		conn = drmModeGetConnector(fd, res->connectors[i]);
 		if (!conn) {
@@ -281,17 +379,26 @@ static int modeset_prepare(int fd)
 	return 0;
 }
 
+/* Whether two modes have the same timings */
+static int modeset_same_mode(const drmModeModeInfo *a, const drmModeModeInfo *b)
+{
+	return a->clock == b->clock &&
+	       a->hdisplay == b->hdisplay && a->hsync_start == b->hsync_start &&
+	       a->hsync_end == b->hsync_end && a->htotal == b->htotal &&
+	       a->vdisplay == b->vdisplay && a->vsync_start == b->vsync_start &&
+	       a->vsync_end == b->vsync_end && a->vtotal == b->vtotal &&
+	       a->flags == b->flags;
+}
+
 /*
  * Now we dig deeper into setting up a single connector. As described earlier,
  * we need to check several things first:
  *   * If the connector is currently unused, that is, no monitor is plugged in,
  *     then we can ignore it.
  *   * We have to find a suitable resolution and refresh-rate. All this is
- *     available in drmModeModeInfo structures saved for each crtc. We simply
- *     use the first mode that is available. This is always the mode with the
- *     highest resolution.
- *     A more sophisticated mode-selection should be done in real applications,
- *     though.
+ *     available in drmModeModeInfo structures saved for each crtc. We use the
+ *     mode the display reports as preferred, which is its native resolution,
+ *     or the first mode, which has the highest resolution, if there is none.
  *   * Then we need to find an CRTC that can drive this connector. A CRTC is an
  *     internal resource of each graphics-card. The number of CRTCs controls how
  *     many connectors can be controlled indepedently. That is, a graphics-cards
@@ -305,7 +412,7 @@ static int modeset_prepare(int fd)
  *     If there are more pipelines than CRTCs, then we cannot control all of
  *     them at the same time.
  *   * We need to create a framebuffer for this connector. A framebuffer is a
- *     memory buffer that we can write XRGB32 data into. So we use this to
+ *     memory buffer that we can write pixel data into. So we use this to
  *     render our graphics and then the CRTC can scan-out this data from the
  *     framebuffer onto the monitor.
  */
@@ -313,7 +420,10 @@ static int modeset_prepare(int fd)
 static int modeset_setup_dev(int fd, drmModeRes *res, drmModeConnector *conn,
 			     struct modeset_dev *dev)
 {
-	int ret;
+	struct modeset_dev *iter;
+	drmModeModeInfo *mode;
+	drmModeCrtc *crtc;
+	int i, ret;
 
 	/* check if a monitor is connected */
 	if (conn->connection != DRM_MODE_CONNECTED) {
@@ -329,27 +439,71 @@ static int modeset_setup_dev(int fd, drmModeRes *res, drmModeConnector *conn,
 		return -EFAULT;
 	}
 
+	/* find a crtc for this connector */
+	ret = modeset_find_crtc(fd, res, conn, dev);
+	if (ret) {
+		fprintf(stderr, "no valid crtc for connector %u\n",
+			conn->connector_id);
+		return ret;
+	}
+
+	/* pick the preferred mode */
+	mode = &conn->modes[0];
+	for (i = 0; i < conn->count_modes; ++i) {
+		if (conn->modes[i].type & DRM_MODE_TYPE_PREFERRED) {
+			mode = &conn->modes[i];
+			break;
+		}
+	}
+
+	/* when taking over, rather keep what the CRTC is already showing */
+	if (modeset_takeover) {
+		crtc = drmModeGetCrtc(fd, dev->crtc);
+		for (i = 0; crtc && crtc->mode_valid && crtc->buffer_id &&
+			    i < conn->count_modes; ++i) {
+			if (modeset_same_mode(&crtc->mode, &conn->modes[i])) {
+				mode = &conn->modes[i];
+				dev->keep_mode = 1;
+				break;
+			}
+		}
+		drmModeFreeCrtc(crtc);
+	}
+
 	/* copy the mode information into our device structure and into both
 	 * buffers */
-	memcpy(&dev->mode, &conn->modes[0], sizeof(dev->mode));
-	dev->width = conn->modes[0].hdisplay;
-	dev->height = conn->modes[0].vdisplay;
+	memcpy(&dev->mode, mode, sizeof(dev->mode));
+	dev->width = mode->hdisplay;
+	dev->height = mode->vdisplay;
 	dev->bufs[0].width = dev->width;
 	dev->bufs[0].height = dev->height;
 	dev->bufs[1].width = dev->width;
 	dev->bufs[1].height = dev->height;
-	fprintf(stderr, "mode for connector %u is %ux%u\n",
-		conn->connector_id, dev->width, dev->height);
+	fprintf(stderr, "mode for connector %u is %ux%u%s\n",
+		conn->connector_id, dev->width, dev->height,
+		dev->keep_mode ? " (kept)" : "");
 
-	/* find a crtc for this connector */
-	ret = modeset_find_crtc(fd, res, conn, dev);
+	/* pick the buffer format, or check this CRTC can scan it out */
+	ret = modeset_choose_format(fd, dev->crtc);
 	if (ret) {
-		fprintf(stderr, "no valid crtc for connector %u\n",
+		fprintf(stderr, "no common pixel format for connector %u\n",
 			conn->connector_id);
 		return ret;
 	}
 
-	/* create framebuffer #1 for this CRTC */
+	/* share the buffers of a connector with the same resolution */
+	for (iter = modeset_list; iter; iter = iter->next) {
+		if (!iter->shared && iter->width == dev->width &&
+		    iter->height == dev->height) {
+			fprintf(stderr, "connector %u shares the framebuffer of "
+				"connector %u\n", conn->connector_id, iter->conn);
+			dev->shared = iter;
+			return 0;
+		}
+	}
+
+	/* create framebuffer #1 for this CRTC, #2 is only created once the
+	 * first frame is on screen, see modeset_create_back() */
 	ret = modeset_create_fb(fd, &dev->bufs[0]);
 	if (ret) {
 		fprintf(stderr, "cannot create framebuffer for connector %u\n",
@@ -357,22 +511,51 @@ static int modeset_setup_dev(int fd, drmModeRes *res, drmModeConnector *conn,
 		return ret;
 	}
 
-	/* create framebuffer #2 for this CRTC */
-	ret = modeset_create_fb(fd, &dev->bufs[1]);
-	if (ret) {
-		fprintf(stderr, "cannot create framebuffer for connector %u\n",
-			conn->connector_id);
-		modeset_destroy_fb(fd, &dev->bufs[0]);
-		return ret;
+	/* the first frame is drawn into it as the back buffer */
+	dev->front_buf = modeset_single ? 0 : 1;
+
+	return 0;
+}
+
+/*
+ * modeset_choose_format(fd, crtc): Pick the buffer format for the first
+ * device from the formats its primary plane supports, in order of
+ * preference. For further devices just check that their primary plane
+ * supports the format already picked. Without universal planes, or if the
+ * driver lists no primary plane, assume XRGB8888 like legacy drivers do.
+ */
+
+static int modeset_choose_format(int fd, uint32_t crtc)
+{
+	const struct modeset_format *format = modeset_format;
+	unsigned int i, pass;
+
+	/* XRGB8888 is assumed to work everywhere, as it did before */
+	if (format) {
+		if (format->fourcc == DRM_FORMAT_XRGB8888 ||
+		    modeset_find_plane(fd, crtc, DRM_PLANE_TYPE_PRIMARY,
+				       format->fourcc))
+			return 0;
+		return -EINVAL;
 	}
 
-	if (dev->bufs[0].size != dev->bufs[1].size) {
-		fprintf(stderr, "front buffer size %" PRIu32 " does not match "
-				"back buffer size %" PRIu32 "\n",
-				dev->bufs[0].size, dev->bufs[1].size);
-		return -1;
+	/* try formats of the preferred depth first, then the others */
+	for (pass = 0; pass < 2 && !format; ++pass) {
+		for (i = 0; i < MODESET_FORMAT_COUNT && !format; ++i) {
+			if ((modeset_formats[i].bpp == modeset_bpp) == pass)
+				continue;
+			if (modeset_find_plane(fd, crtc, DRM_PLANE_TYPE_PRIMARY,
+					       modeset_formats[i].fourcc))
+				format = &modeset_formats[i];
+		}
 	}
 
+	if (!format)
+		format = &modeset_formats[0];
+
+	fprintf(stderr, "using pixel format %.4s\n",
+		(const char *)&format->fourcc);
+	modeset_format = format;
 	return 0;
 }
 
@@ -504,13 +687,14 @@ static int modeset_create_fb(int fd, struct modeset_buf *buf)
 	struct drm_mode_create_dumb creq;
 	struct drm_mode_destroy_dumb dreq;
 	struct drm_mode_map_dumb mreq;
+	uint32_t handles[4] = { 0 }, pitches[4] = { 0 }, offsets[4] = { 0 };
 	int ret;
 
 	/* create dumb buffer */
 	memset(&creq, 0, sizeof(creq));
 	creq.width = buf->width;
 	creq.height = buf->height;
-	creq.bpp = 32;
+	creq.bpp = modeset_format->bpp;
 	ret = drmIoctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &creq);
 	if (ret < 0) {
 		fprintf(stderr, "cannot create dumb buffer (%d): %m\n",
@@ -522,8 +706,10 @@ static int modeset_create_fb(int fd, struct modeset_buf *buf)
 	buf->handle = creq.handle;
 
 	/* create framebuffer object for the dumb-buffer */
-	ret = drmModeAddFB(fd, buf->width, buf->height, 24, 32, buf->stride,
-			   buf->handle, &buf->fb);
+	handles[0] = buf->handle;
+	pitches[0] = buf->stride;
+	ret = drmModeAddFB2(fd, buf->width, buf->height, modeset_format->fourcc,
+			    handles, pitches, offsets, &buf->fb, 0);
 	if (ret) {
 		fprintf(stderr, "cannot create framebuffer (%d): %m\n",
 			errno);
@@ -552,8 +738,8 @@ static int modeset_create_fb(int fd, struct modeset_buf *buf)
 		goto err_fb;
 	}
 
-	/* clear the framebuffer to 0 */
-	memset(buf->map, 0, buf->size);
+	/* The kernel hands out dumb buffers cleared, and everything that is
+	 * shown of them is drawn first, so there is no need to clear them. */
 
 	return 0;
 
@@ -577,11 +763,16 @@ static void modeset_destroy_fb(int fd, struct modeset_buf *buf)
 {
 	struct drm_mode_destroy_dumb dreq;
 
+	/* the back buffer isn't created in single buffer mode */
+	if (!buf->map)
+		return;
+
 	/* unmap buffer */
 	munmap(buf->map, buf->size);
 
-	/* delete framebuffer */
-	drmModeRmFB(fd, buf->fb);
+	/* delete framebuffer, unless it was handed over */
+	if (buf->fb)
+		drmModeRmFB(fd, buf->fb);
 
 	/* delete dumb buffer */
 	memset(&dreq, 0, sizeof(dreq));
@@ -589,37 +780,713 @@ static void modeset_destroy_fb(int fd, struct modeset_buf *buf)
 	drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
 }
 
+/*
+ * Presentation uses page flips rather than a modeset per update: the back
+ * buffer is queued with drmModePageFlip() to be scanned out at the next
+ * vblank, and the kernel reports completion as an event on the DRM fd. Until
+ * then the old front buffer is still being scanned out, so it must not be
+ * drawn to. The main loop watches the fd through canvas.event_fd and calls
+ * psplash_drm_handle_events() to wait for the flip before drawing again.
+ *
+ * Once a flip completes, the areas drawn into the new front buffer are
+ * copied to the new back buffer, so both hold the same scene.
+ */
+
+/* How long to wait for a flip that should complete at the next vblank */
+#define PSPLASH_DRM_FLIP_TIMEOUT_MS 1000
+
+/* The device whose buffers a canvas draws into */
+static struct modeset_dev *modeset_canvas_dev(PSplashCanvas *canvas)
+{
+	struct modeset_dev *iter;
+
+	for (iter = modeset_list; iter; iter = iter->next)
+		if (iter->canvas == canvas)
+			return iter;
+
+	return NULL;
+}
+
+/* Create the back buffer of a device, matching its front buffer */
+static int modeset_create_back(PSplashDRM *drm, struct modeset_dev *dev)
+{
+	struct modeset_buf *front = &dev->bufs[dev->front_buf];
+	struct modeset_buf *back = &dev->bufs[dev->front_buf ^ 1];
+
+	if (modeset_create_fb(drm->fd, back)) {
+		fprintf(stderr, "cannot create back buffer for connector %u\n",
+			dev->conn);
+		return -1;
+	}
+
+	if (back->stride != front->stride || back->size != front->size) {
+		fprintf(stderr, "back buffer stride %" PRIu32 " and size %" PRIu32
+				" do not match front buffer stride %" PRIu32
+				" and size %" PRIu32 "\n",
+				back->stride, back->size,
+				front->stride, front->size);
+		modeset_destroy_fb(drm->fd, back);
+		memset(back, 0, sizeof(*back));
+		back->width = front->width;
+		back->height = front->height;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void modeset_sync_back(struct modeset_dev *dev)
+{
+	void *front = dev->bufs[dev->front_buf].map;
+	void *back = dev->bufs[dev->front_buf ^ 1].map;
+
+	/* drawing into the front buffer for lack of a back buffer */
+	if (!back) {
+		dev->sync_pending = 0;
+		return;
+	}
+
+	if (dev->sync_pending) {
+		memcpy(back, front, dev->bufs[0].size);
+		dev->canvas->n_damage = 0;
+	} else {
+		psplash_canvas_sync_damage(dev->canvas, back, front);
+	}
+
+	dev->sync_pending = 0;
+}
+
+/* Sequence number of the last flip queued, never 0 */
+static unsigned int modeset_flip_seq = 0;
+
+static unsigned int modeset_next_flip_seq(void)
+{
+	if (!++modeset_flip_seq)
+		++modeset_flip_seq;
+
+	return modeset_flip_seq;
+}
+
+static long long modeset_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* Finish the flip of a canvas once it completed on every CRTC, or was given
+ * up on. Clearing the sequence number makes any event of it still to come
+ * stale. */
+static void modeset_flip_done(PSplashCanvas *canvas)
+{
+	struct modeset_dev *dev;
+
+	if (modeset_layer && canvas == &modeset_layer->canvas) {
+		modeset_layer->flip_pending = 0;
+		modeset_layer->flip_seq = 0;
+		psplash_canvas_sync_damage(canvas,
+			modeset_layer_data(modeset_layer,
+					   modeset_layer->front_buf ^ 1),
+			modeset_layer_data(modeset_layer,
+					   modeset_layer->front_buf));
+		return;
+	}
+
+	dev = modeset_canvas_dev(canvas);
+	dev->flip_pending = 0;
+	dev->flip_seq = 0;
+	modeset_sync_back(dev);
+}
+
+static void modeset_page_flip_event(int fd, unsigned int frame,
+				    unsigned int sec, unsigned int usec,
+				    void *data)
+{
+	unsigned int seq = (uintptr_t)data;
+	struct modeset_dev *iter;
+
+	(void)fd;
+	(void)frame;
+	(void)sec;
+	(void)usec;
+
+	if (modeset_layer && seq == modeset_layer->flip_seq) {
+		modeset_flip_done(&modeset_layer->canvas);
+		return;
+	}
+
+	/* Events of a flip that timed out match nothing and are dropped, they
+	 * must not complete a later flip */
+	for (iter = modeset_list; iter; iter = iter->next) {
+		if (iter->shared || seq != iter->flip_seq)
+			continue;
+
+		/* a shared buffer is flipped on several CRTCs, one event each */
+		if (--iter->flip_pending <= 0)
+			modeset_flip_done(iter->canvas);
+		return;
+	}
+}
+
+/* Queued time of whichever plane a canvas is shown on */
+static long long *modeset_flip_queued(PSplashCanvas *canvas)
+{
+	if (modeset_layer && canvas == &modeset_layer->canvas)
+		return &modeset_layer->flip_queued;
+
+	return &modeset_canvas_dev(canvas)->flip_queued;
+}
+
+/* Don't hang the boot on a display that stopped */
+static void modeset_flip_timeout(PSplashCanvas *canvas)
+{
+	fprintf(stderr, "page flip did not complete\n");
+	modeset_flip_done(canvas);
+}
+
+/* The pending flip count of whichever plane a canvas is shown on */
+static int *modeset_flip_pending(PSplashCanvas *canvas)
+{
+	if (modeset_layer && canvas == &modeset_layer->canvas)
+		return &modeset_layer->flip_pending;
+
+	return &modeset_canvas_dev(canvas)->flip_pending;
+}
+
+static int psplash_drm_flip_pending(PSplashCanvas *canvas)
+{
+	if (*modeset_flip_pending(canvas) <= 0)
+		return 0;
+
+	/* nothing else waits for the flip, so give up on it here */
+	if (modeset_now_ms() - *modeset_flip_queued(canvas) >=
+	    PSPLASH_DRM_FLIP_TIMEOUT_MS) {
+		modeset_flip_timeout(canvas);
+		return 0;
+	}
+
+	return 1;
+}
+
+static void psplash_drm_handle_events(PSplashCanvas *canvas, int wait)
+{
+	PSplashDRM *drm = canvas->priv;
+	int *pending = modeset_flip_pending(canvas);
+	drmEventContext ev;
+	struct pollfd pfd;
+	int ret;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.version = 2;
+	ev.page_flip_handler = modeset_page_flip_event;
+
+	if (!wait) {
+		drmHandleEvent(drm->fd, &ev);
+		return;
+	}
+
+	pfd.fd = drm->fd;
+	pfd.events = POLLIN;
+
+	while (*pending) {
+		ret = poll(&pfd, 1, PSPLASH_DRM_FLIP_TIMEOUT_MS);
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret <= 0) {
+			modeset_flip_timeout(canvas);
+			return;
+		}
+
+		drmHandleEvent(drm->fd, &ev);
+	}
+}
+
+/*
+ * In single buffer mode, used only when asked for with --drm-single-buffer,
+ * there is no back buffer: the canvas draws straight into the scanned out
+ * buffer, halving the memory used. The splash changes little and only in
+ * small areas, so tearing is hardly visible. A "flip" then
+ * just reports the damaged areas through drmModeDirtyFB(), for drivers
+ * that copy the buffer to the display themselves and need to know what
+ * changed. Others ignore it.
+ */
+
+static void psplash_drm_flip_single(PSplashCanvas *canvas, int sync)
+{
+	PSplashDRM *drm = canvas->priv;
+	struct modeset_dev *dev = modeset_canvas_dev(canvas);
+	struct modeset_buf *buf = &dev->bufs[dev->front_buf];
+	drmModeClip clips[PSPLASH_MAX_DAMAGE];
+	struct modeset_dev *iter;
+	int i, n = canvas->n_damage;
+
+	for (i = 0; i < n; ++i) {
+		clips[i].x1 = canvas->damage[i].x;
+		clips[i].y1 = canvas->damage[i].y;
+		clips[i].x2 = canvas->damage[i].x + canvas->damage[i].width;
+		clips[i].y2 = canvas->damage[i].y + canvas->damage[i].height;
+	}
+	canvas->n_damage = 0;
+
+	/* CRTCs not showing the buffer yet get it now */
+	for (iter = modeset_list; iter; iter = iter->next) {
+		if ((iter != dev && iter->shared != dev) || iter->shown)
+			continue;
+
+		if (drmModeSetCrtc(drm->fd, iter->crtc, buf->fb, 0, 0,
+				   &iter->conn, 1, &iter->mode))
+			fprintf(stderr, "cannot set CRTC for connector %u (%d): %m\n",
+				iter->conn, errno);
+		else
+			iter->shown = 1;
+	}
+
+	if (sync)
+		drmModeDirtyFB(drm->fd, buf->fb, NULL, 0);
+	else if (n)
+		drmModeDirtyFB(drm->fd, buf->fb, clips, n);
+}
+
 static void psplash_drm_flip(PSplashCanvas *canvas, int sync)
 {
 	PSplashDRM *drm = canvas->priv;
+	struct modeset_dev *dev = modeset_canvas_dev(canvas);
+	struct modeset_dev *iter;
+	struct modeset_buf *buf;
+	int shown = 0;
+
+	/* only one flip can be queued at a time */
+	psplash_drm_handle_events(canvas, 1);
+
+	/* pick a back buffer */
+	buf = &dev->bufs[dev->front_buf ^ 1];
+
+	/* queue back buffer to become the front buffer at the next vblank on
+	 * every CRTC showing it */
+	dev->flip_seq = modeset_next_flip_seq();
+	dev->flip_queued = modeset_now_ms();
+	for (iter = modeset_list; iter; iter = iter->next) {
+		if (iter != dev && iter->shared != dev)
+			continue;
+
+		/* the first frame sets the mode, unless it is kept */
+		if ((iter->shown || iter->keep_mode) &&
+		    !drmModePageFlip(drm->fd, iter->crtc, buf->fb,
+				     DRM_MODE_PAGE_FLIP_EVENT,
+				     (void *)(uintptr_t)dev->flip_seq)) {
+			dev->flip_pending++;
+			iter->shown = 1;
+			shown++;
+			continue;
+		}
+
+		/* fall back to a modeset if the driver can't flip */
+		if (drmModeSetCrtc(drm->fd, iter->crtc, buf->fb, 0, 0,
+				   &iter->conn, 1, &iter->mode)) {
+			fprintf(stderr, "cannot flip CRTC for connector %u (%d): %m\n",
+				iter->conn, errno);
+			continue;
+		}
+		iter->shown = 1;
+		shown++;
+	}
+
+	if (!shown)
+		return;
+
+	/* update front buffer index */
+	dev->front_buf ^= 1;
+
+	/* With the first frame up, create the other buffer to draw the next
+	 * one in. Without it, keep drawing into the one on screen. */
+	if (!dev->bufs[dev->front_buf ^ 1].map && modeset_create_back(drm, dev)) {
+		fprintf(stderr, "drawing into the front buffer instead\n");
+		canvas->flip = psplash_drm_flip_single;
+		canvas->data = dev->bufs[dev->front_buf].map;
+		canvas->n_damage = 0;
+		return;
+	}
+
+	/* update back buffer pointer */
+	canvas->data = dev->bufs[dev->front_buf ^ 1].map;
+
+	/* Sync new front to new back, entirely when requested and otherwise
+	 * just the areas drawn since the last flip. With a flip queued this
+	 * waits until the new back buffer is no longer scanned out. */
+	dev->sync_pending = sync;
+
+	if (!dev->flip_pending)
+		modeset_sync_back(dev);
+}
+
+
+/*
+ * With atomic modesetting, the parts of the splash that change can be shown
+ * on an overlay plane, leaving the scene on the primary plane untouched after
+ * the first frame. psplash_drm_new_layer() finds an overlay plane for our
+ * CRTC and gives it a pair of buffers. The plane is positioned over the
+ * requested rectangle and scans out only that part of them, so updates just
+ * write a few rows and commit the plane's new FB_ID.
+ *
+ * The layer buffers only hold the rectangle. The layer canvas keeps the
+ * geometry of the primary one, with its data pointer moved back by the
+ * rectangle's offset so screen coordinates inside the rectangle land in the
+ * buffer, and its clip set to the rectangle so nothing outside is written.
+ * Once the layer is up the primary plane's back buffer is freed, as nothing
+ * draws there any more.
+ */
+
+
+/*
+ * modeset_get_prop(fd, obj, type, name, value): Look up the id of a property
+ * of a KMS object by name, and optionally its current value. Returns 0 if the
+ * object has no such property.
+ */
+
+static uint32_t modeset_get_prop(int fd, uint32_t obj, uint32_t type,
+				 const char *name, uint64_t *value)
+{
+	drmModeObjectProperties *props;
+	drmModePropertyRes *prop;
+	uint32_t i, id = 0;
+
+	props = drmModeObjectGetProperties(fd, obj, type);
+	if (!props)
+		return 0;
+
+	for (i = 0; i < props->count_props && !id; ++i) {
+		prop = drmModeGetProperty(fd, props->props[i]);
+		if (!prop)
+			continue;
+
+		if (!strcmp(prop->name, name)) {
+			id = prop->prop_id;
+			if (value)
+				*value = props->prop_values[i];
+		}
+
+		drmModeFreeProperty(prop);
+	}
+
+	drmModeFreeObjectProperties(props);
+	return id;
+}
+
+/*
+ * modeset_find_plane(fd, crtc, type, format): Find a plane of the given type
+ * that can be used with the CRTC and scans out the format. Returns 0 if there
+ * is none.
+ */
+
+static uint32_t modeset_find_plane(int fd, uint32_t crtc, uint64_t type,
+				   uint32_t format)
+{
+	drmModeRes *res;
+	drmModePlaneRes *planes;
+	drmModePlane *plane;
+	uint32_t i, j, id = 0;
+	uint64_t plane_type;
+	int index = -1;
+
+	res = drmModeGetResources(fd);
+	if (!res)
+		return 0;
+
+	for (i = 0; i < (uint32_t)res->count_crtcs; ++i)
+		if (res->crtcs[i] == crtc)
+			index = i;
+	drmModeFreeResources(res);
+
+	planes = drmModeGetPlaneResources(fd);
+	if (!planes || index < 0) {
+		drmModeFreePlaneResources(planes);
+		return 0;
+	}
+
+	for (i = 0; i < planes->count_planes && !id; ++i) {
+		plane = drmModeGetPlane(fd, planes->planes[i]);
+		if (!plane)
+			continue;
+
+		if ((plane->possible_crtcs & (1 << index)) &&
+		    modeset_get_prop(fd, plane->plane_id,
+				     DRM_MODE_OBJECT_PLANE, "type", &plane_type) &&
+		    plane_type == type) {
+			for (j = 0; j < plane->count_formats; ++j)
+				if (plane->formats[j] == format)
+					id = plane->plane_id;
+		}
+
+		drmModeFreePlane(plane);
+	}
+
+	drmModeFreePlaneResources(planes);
+	return id;
+}
+
+/*
+ * modeset_commit_layer(fd, layer, fb, flags): Show a layer buffer on the
+ * overlay plane over the layer's rectangle with an atomic commit. A flip
+ * event carries the layer's flip_seq.
+ */
+
+static int modeset_commit_layer(int fd, struct modeset_layer *layer,
+				uint32_t fb, uint32_t flags)
+{
+	drmModeAtomicReq *req;
+	uint64_t values[PLANE_PROP_COUNT];
+	int i, ret;
+
+	values[PLANE_FB_ID] = fb;
+	values[PLANE_CRTC_ID] = fb ? modeset_list->crtc : 0;
+	values[PLANE_SRC_X] = 0;
+	values[PLANE_SRC_Y] = 0;
+	values[PLANE_SRC_W] = (uint64_t)layer->rect.width << 16;
+	values[PLANE_SRC_H] = (uint64_t)layer->rect.height << 16;
+	values[PLANE_CRTC_X] = layer->rect.x;
+	values[PLANE_CRTC_Y] = layer->rect.y;
+	values[PLANE_CRTC_W] = layer->rect.width;
+	values[PLANE_CRTC_H] = layer->rect.height;
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -ENOMEM;
+
+	for (i = 0; i < PLANE_PROP_COUNT; ++i)
+		drmModeAtomicAddProperty(req, layer->plane, layer->props[i],
+					 values[i]);
+
+	ret = drmModeAtomicCommit(fd, req, flags,
+				  (void *)(uintptr_t)layer->flip_seq);
+	drmModeAtomicFree(req);
+	return ret;
+}
+
+static void psplash_drm_layer_flip(PSplashCanvas *canvas, int sync)
+{
+	PSplashDRM *drm = canvas->priv;
+	struct modeset_layer *layer = modeset_layer;
 	struct modeset_buf *buf;
 	int ret;
 
 	(void)sync;
 
-	/* pick a back buffer */
-	buf = &modeset_list->bufs[modeset_list->front_buf ^ 1];
+	/* only one commit can be pending on the plane at a time */
+	psplash_drm_handle_events(canvas, 1);
+
+	buf = &layer->bufs[layer->front_buf ^ 1];
 
-	/* set back buffer as a front buffer */
-	ret = drmModeSetCrtc(drm->fd, modeset_list->crtc, buf->fb, 0, 0,
-			&modeset_list->conn, 1, &modeset_list->mode);
+	layer->flip_seq = modeset_next_flip_seq();
+	ret = modeset_commit_layer(drm->fd, layer, buf->fb,
+				   DRM_MODE_ATOMIC_NONBLOCK |
+				   DRM_MODE_PAGE_FLIP_EVENT);
 	if (ret) {
-		fprintf(stderr, "cannot flip CRTC for connector %u (%d): %m\n",
-			modeset_list->conn, errno);
+		fprintf(stderr, "cannot commit overlay plane %u (%d): %m\n",
+			layer->plane, errno);
+		layer->flip_seq = 0;
 		return;
 	}
 
-	/* update front buffer index */
-	modeset_list->front_buf ^= 1;
+	layer->front_buf ^= 1;
+	layer->canvas.data = modeset_layer_data(layer, layer->front_buf ^ 1);
+	layer->flip_pending = 1;
+	layer->flip_queued = modeset_now_ms();
+}
 
-	/* update back buffer pointer */
-	drm->canvas.data = modeset_list->bufs[modeset_list->front_buf ^ 1].map;
+static PSplashCanvas *psplash_drm_new_layer(PSplashCanvas *canvas, int x,
+					     int y, int width, int height)
+{
+	PSplashDRM *drm = canvas->priv;
+	struct modeset_dev *dev = modeset_canvas_dev(canvas);
+	struct modeset_buf *back;
+	struct modeset_layer *layer;
+	int i, row, bytespp = canvas->bpp >> 3;
+	char *src;
+
+	/* the overlay is set up for a single CRTC, and would take two more
+	 * buffers where memory is being saved */
+	if (modeset_layer || modeset_list->next || modeset_single)
+		return NULL;
+
+	if (drmSetClientCap(drm->fd, DRM_CLIENT_CAP_ATOMIC, 1))
+		return NULL;
+
+	layer = malloc(sizeof(*layer));
+	if (!layer)
+		return NULL;
+	memset(layer, 0, sizeof(*layer));
+
+	layer->rect.x = x;
+	layer->rect.y = y;
+	layer->rect.width = width;
+	layer->rect.height = height;
+	psplash_canvas_map_rect(canvas, &layer->rect);
+	if (!layer->rect.width)
+		goto err_free;
+
+	layer->plane = modeset_find_plane(drm->fd, modeset_list->crtc,
+					  DRM_PLANE_TYPE_OVERLAY,
+					  modeset_format->fourcc);
+	if (!layer->plane)
+		goto err_free;
+
+	for (i = 0; i < PLANE_PROP_COUNT; ++i) {
+		layer->props[i] = modeset_get_prop(drm->fd, layer->plane,
+						   DRM_MODE_OBJECT_PLANE,
+						   modeset_plane_prop_names[i],
+						   NULL);
+		if (!layer->props[i])
+			goto err_free;
+	}
 
-	/* Sync new front to new back when requested */
-	if (sync)
-		memcpy(modeset_list->bufs[modeset_list->front_buf ^ 1].map,
-			modeset_list->bufs[modeset_list->front_buf].map,
-			modeset_list->bufs[0].size);
+	for (i = 0; i < 2; ++i) {
+		layer->bufs[i].width = layer->rect.width;
+		layer->bufs[i].height = layer->rect.height;
+		if (modeset_create_fb(drm->fd, &layer->bufs[i])) {
+			if (i)
+				modeset_destroy_fb(drm->fd, &layer->bufs[0]);
+			goto err_free;
+		}
+	}
+
+	if (layer->bufs[0].stride != layer->bufs[1].stride) {
+		fprintf(stderr, "overlay buffer strides do not match\n");
+		goto err_destroy;
+	}
+
+	/* check that the plane can show the rectangle at all */
+	if (modeset_commit_layer(drm->fd, layer, layer->bufs[0].fb,
+				 DRM_MODE_ATOMIC_TEST_ONLY))
+		goto err_destroy;
+
+	/* the primary plane's last frame must be complete to copy it */
+	psplash_drm_handle_events(canvas, 1);
+
+	for (i = 0; i < 2; ++i) {
+		src = canvas->data + layer->rect.y * canvas->stride +
+		      layer->rect.x * bytespp;
+		for (row = 0; row < layer->rect.height; ++row,
+		     src += canvas->stride)
+			memcpy((char *)layer->bufs[i].map +
+			       row * layer->bufs[i].stride, src,
+			       layer->rect.width * bytespp);
+	}
+
+	layer->canvas = *canvas;
+	layer->canvas.stride = layer->bufs[1].stride;
+	layer->canvas.data = modeset_layer_data(layer, 1);
+	layer->canvas.flip = psplash_drm_layer_flip;
+	layer->canvas.new_layer = NULL;
+	layer->canvas.n_damage = 0;
+	psplash_canvas_set_clip(&layer->canvas, x, y, width, height);
+
+	modeset_layer = layer;
+
+	/* show the first buffer, which is identical to the primary plane */
+	if (modeset_commit_layer(drm->fd, layer, layer->bufs[0].fb, 0)) {
+		fprintf(stderr, "cannot enable overlay plane %u (%d): %m\n",
+			layer->plane, errno);
+		modeset_layer = NULL;
+		goto err_destroy;
+	}
+
+	fprintf(stderr, "using overlay plane %u for %dx%d+%d+%d\n",
+		layer->plane, layer->rect.width, layer->rect.height,
+		layer->rect.x, layer->rect.y);
+
+	/* The scene stays on the primary plane's front buffer, the back
+	 * buffer isn't drawn into again. Should the primary plane need
+	 * updating, it is drawn into directly. */
+	back = &dev->bufs[dev->front_buf ^ 1];
+	if (back->map) {
+		modeset_destroy_fb(drm->fd, back);
+		memset(back, 0, sizeof(*back));
+		back->width = dev->width;
+		back->height = dev->height;
+		canvas->data = dev->bufs[dev->front_buf].map;
+		canvas->flip = psplash_drm_flip_single;
+		canvas->n_damage = 0;
+	}
+
+	return &layer->canvas;
+
+err_destroy:
+	modeset_destroy_fb(drm->fd, &layer->bufs[1]);
+	modeset_destroy_fb(drm->fd, &layer->bufs[0]);
+err_free:
+	free(layer);
+	return NULL;
+}
+
+static void modeset_destroy_layer(PSplashDRM *drm)
+{
+	struct modeset_layer *layer = modeset_layer;
+
+	if (!layer)
+		return;
+
+	if (layer->flip_pending)
+		psplash_drm_handle_events(&layer->canvas, 1);
+
+	/* take the plane off the screen before its buffers go away */
+	modeset_commit_layer(drm->fd, layer, 0, 0);
+
+	modeset_destroy_fb(drm->fd, &layer->bufs[1]);
+	modeset_destroy_fb(drm->fd, &layer->bufs[0]);
+	modeset_layer = NULL;
+	free(layer);
+}
+
+/* Point a canvas at the back buffer of a device, in its geometry */
+static int modeset_setup_canvas(PSplashDRM *drm, struct modeset_dev *dev,
+				int angle)
+{
+	PSplashCanvas *canvas = dev->canvas;
+
+	canvas->data = dev->bufs[0].map;
+	canvas->width = dev->width;
+	canvas->height = dev->height;
+	canvas->bpp = modeset_format->bpp;
+
+	canvas->stride = dev->bufs[0].stride;
+
+	canvas->angle = angle;
+	canvas->rgbmode = modeset_format->rgbmode;
+
+	/*
+	 * There seems some difference about handling portrait angle between
+	 * pure drm vs drm-lease. We'd use a method as same with psplash-fb
+	 * for drm-lease devices.
+	 */
+#ifdef ENABLE_DRM_LEASE
+	if (drm_lease_name) {
+		switch (angle) {
+			case 270:
+			case 90:
+				canvas->width  = dev->height;
+				canvas->height = dev->width;
+				break;
+			default:
+				break;
+		}
+	}
+#endif
+
+	canvas->priv = drm;
+	canvas->flip = modeset_single ? psplash_drm_flip_single
+				      : psplash_drm_flip;
+
+	/* page flip events arrive on the DRM fd */
+	canvas->event_fd = drm->fd;
+	canvas->handle_events = psplash_drm_handle_events;
+	canvas->flip_pending = psplash_drm_flip_pending;
+	canvas->new_layer = psplash_drm_new_layer;
+
+	psplash_canvas_setup(canvas);
+
+	return 0;
 }
 
 /*
@@ -657,21 +1524,23 @@ static void psplash_drm_flip(PSplashCanvas *canvas, int sync)
  * application performs modesetting itself.
  */
 
-PSplashDRM* psplash_drm_new(int angle, int dev_id)
+PSplashDRM* psplash_drm_new(int angle, int dev_id, int bpp, int flags)
 {
 	PSplashDRM *drm = NULL;
 	int ret;
 	char card[] = "/dev/dri/card0";
 	struct modeset_dev *iter;
-	struct modeset_buf *buf;
+	PSplashCanvas **next;
 
 	if ((drm = malloc(sizeof(*drm))) == NULL) {
 		perror("malloc");
 		goto error;
 	}
-	drm->fd = 0;
-	drm->canvas.priv = drm;
-	drm->canvas.flip = psplash_drm_flip;
+	memset(drm, 0, sizeof(*drm));
+
+	modeset_bpp = bpp;
+	modeset_takeover = !!(flags & PSPLASH_DRM_TAKEOVER);
+	modeset_single = !!(flags & PSPLASH_DRM_SINGLE_BUFFER);
 
 	if (dev_id > 0 && dev_id < 10) {
 		// Conversion from integer to ascii.
@@ -703,54 +1572,39 @@ PSplashDRM* psplash_drm_new(int angle, int dev_id)
 			goto error;
 	}
 
+	if (modeset_single)
+		fprintf(stderr, "using a single buffer\n");
+
 	/* prepare all connectors and CRTCs */
 	ret = modeset_prepare(drm->fd);
 	if (ret)
 		goto error;
 
-	/* perform actual modesetting on each found connector+CRTC */
-	for (iter = modeset_list; iter; iter = iter->next) {
+	/* Save the CRTC configuration of each found connector+CRTC. The
+	 * actual modesetting is done by the first flip, which shows the first
+	 * frame, so the display isn't set to a blank buffer before it. */
+	for (iter = modeset_list; iter; iter = iter->next)
 		iter->saved_crtc = drmModeGetCrtc(drm->fd, iter->crtc);
-		buf = &iter->bufs[iter->front_buf];
-		ret = drmModeSetCrtc(drm->fd, iter->crtc, buf->fb, 0, 0,
-				     &iter->conn, 1, &iter->mode);
-		if (ret)
-			fprintf(stderr, "cannot set CRTC for connector %u (%d): %m\n",
-				iter->conn, errno);
-	}
-
-	drm->canvas.data = modeset_list->bufs[modeset_list->front_buf ^ 1].map;
-	drm->canvas.width = modeset_list->width;
-	drm->canvas.height = modeset_list->height;
-	drm->canvas.bpp = 32;
 
-	if (modeset_list->bufs[0].stride != modeset_list->bufs[1].stride) {
-		fprintf(stderr, "front buffer stride %" PRIu32 " does not match"
-				" back buffer stride %" PRIu32 "\n",
-				modeset_list->bufs[0].stride,
-				modeset_list->bufs[1].stride);
-		goto error;
-	}
-	drm->canvas.stride = modeset_list->bufs[0].stride;
-
-	drm->canvas.angle = angle;
-	drm->canvas.rgbmode = RGB888;
+	/* one canvas for each set of buffers, the first one embedded */
+	next = NULL;
+	for (iter = modeset_list; iter; iter = iter->next) {
+		if (iter->shared)
+			continue;
 
-	/*
-	 * There seems some difference about handling portrait angle between
-	 * pure drm vs drm-lease. We'd use a method as same with psplash-fb
-	 * for drm-lease devices.
-	 */
-	if (drm_lease_name) {
-		switch (angle) {
-			case 270:
-			case 90:
-				drm->canvas.width  = modeset_list->height;
-				drm->canvas.height = modeset_list->width;
-				break;
-			default:
-				break;
+		if (!next) {
+			iter->canvas = &drm->canvas;
+		} else if ((iter->canvas = malloc(sizeof(*iter->canvas)))) {
+			memset(iter->canvas, 0, sizeof(*iter->canvas));
+			*next = iter->canvas;
+		} else {
+			perror("malloc");
+			goto error;
 		}
+		next = &iter->canvas->next;
+
+		if (modeset_setup_canvas(drm, iter, angle))
+			goto error;
 	}
 
 	return drm;
@@ -759,6 +1613,75 @@ error:
 	return NULL;
 }
 
+/*
+ * psplash_drm_keep(drm): Hand the frame on screen over to the next DRM
+ * master, so it can take over without a modeset or a blank screen in
+ * between. The front buffers are closed with DRM_IOCTL_MODE_CLOSEFB, which
+ * drops our handle but leaves them scanned out, where removing them would
+ * turn the CRTCs off. psplash_drm_destroy() then leaves those CRTCs as they
+ * are. Without CLOSEFB, from Linux 6.8 on, they are restored as usual.
+ */
+
+void psplash_drm_keep(PSplashDRM *drm)
+{
+	struct modeset_layer *layer = modeset_layer;
+	struct modeset_dev *iter;
+	struct modeset_buf *buf;
+	PSplashCanvas *canvas;
+	char *src, *dst;
+	int row, bytespp;
+
+	for (iter = modeset_list; iter; iter = iter->next)
+		if (iter->flip_pending)
+			psplash_drm_handle_events(iter->canvas, 1);
+
+	/* put what the overlay shows back on the primary plane first */
+	if (layer) {
+		if (layer->flip_pending)
+			psplash_drm_handle_events(&layer->canvas, 1);
+
+		canvas = modeset_list->canvas;
+		bytespp = canvas->bpp >> 3;
+		src = layer->bufs[layer->front_buf].map;
+		dst = canvas->data + layer->rect.y * canvas->stride +
+		      layer->rect.x * bytespp;
+		for (row = 0; row < layer->rect.height; ++row,
+		     src += layer->bufs[layer->front_buf].stride,
+		     dst += canvas->stride)
+			memcpy(dst, src, layer->rect.width * bytespp);
+
+		canvas->flip(canvas, 1);
+		psplash_drm_handle_events(canvas, 1);
+		modeset_destroy_layer(drm);
+	}
+
+#ifdef DRM_IOCTL_MODE_CLOSEFB
+	for (iter = modeset_list; iter; iter = iter->next) {
+		struct drm_mode_closefb creq;
+
+		if (iter->shared) {
+			iter->kept = iter->shared->kept;
+			continue;
+		}
+
+		buf = &iter->bufs[iter->front_buf];
+		memset(&creq, 0, sizeof(creq));
+		creq.fb_id = buf->fb;
+		if (drmIoctl(drm->fd, DRM_IOCTL_MODE_CLOSEFB, &creq)) {
+			fprintf(stderr, "cannot keep framebuffer on connector "
+				"%u (%d): %m\n", iter->conn, errno);
+			continue;
+		}
+
+		buf->fb = 0;
+		iter->kept = 1;
+	}
+#else
+	(void)buf;
+	fprintf(stderr, "keeping the splash on screen is not supported\n");
+#endif
+}
+
 /*
  * psplash_drm_destroy(drm): This cleans up all the devices we created during
  * modeset_prepare(). It resets the CRTCs to their saved states and deallocates
@@ -773,27 +1696,41 @@ void psplash_drm_destroy(PSplashDRM *drm)
 	if (!drm)
 		return;
 
+	modeset_destroy_layer(drm);
+
+	/* the buffers can't go away while a flip still refers to them */
+	for (iter = modeset_list; iter; iter = iter->next)
+		if (iter->flip_pending)
+			psplash_drm_handle_events(iter->canvas, 1);
+
 	while (modeset_list) {
 		/* remove from global list */
 		iter = modeset_list;
 		modeset_list = iter->next;
 
-		/* restore saved CRTC configuration */
-		drmModeSetCrtc(drm->fd,
-			       iter->saved_crtc->crtc_id,
-			       iter->saved_crtc->buffer_id,
-			       iter->saved_crtc->x,
-			       iter->saved_crtc->y,
-			       &iter->conn,
-			       1,
-			       &iter->saved_crtc->mode);
-		drmModeFreeCrtc(iter->saved_crtc);
-
-		/* destroy framebuffers */
-		modeset_destroy_fb(drm->fd, &iter->bufs[1]);
-		modeset_destroy_fb(drm->fd, &iter->bufs[0]);
+		if (iter->saved_crtc) {
+			/* restore saved CRTC configuration, unless handed over */
+			if (!iter->kept)
+				drmModeSetCrtc(drm->fd,
+					       iter->saved_crtc->crtc_id,
+					       iter->saved_crtc->buffer_id,
+					       iter->saved_crtc->x,
+					       iter->saved_crtc->y,
+					       &iter->conn,
+					       1,
+					       &iter->saved_crtc->mode);
+			drmModeFreeCrtc(iter->saved_crtc);
+		}
+
+		/* destroy framebuffers, unless borrowed from another device */
+		if (!iter->shared) {
+			modeset_destroy_fb(drm->fd, &iter->bufs[1]);
+			modeset_destroy_fb(drm->fd, &iter->bufs[0]);
+		}
 
 		/* free allocated memory */
+		if (iter->canvas && iter->canvas != &drm->canvas)
+			free(iter->canvas);
 		free(iter);
 	}
 
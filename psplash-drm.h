@@ -10,8 +10,17 @@ typedef struct PSplashDRM
 }
 PSplashDRM;
 
+void psplash_drm_keep(PSplashDRM *drm);
+
 void psplash_drm_destroy(PSplashDRM *drm);
 
-PSplashDRM* psplash_drm_new(int angle, int dev_id);
+/* Keep the mode the display is in where possible, so showing the splash
+ * needs no modeset */
+#define PSPLASH_DRM_TAKEOVER		(1 << 0)
+/* Draw into the scanned out buffer rather than flipping two buffers */
+#define PSPLASH_DRM_SINGLE_BUFFER	(1 << 1)
+
+/* bpp is the preferred buffer depth, 16 or 32, used if the display can */
+PSplashDRM* psplash_drm_new(int angle, int dev_id, int bpp, int flags);
 
 #endif
@@ -8,14 +8,104 @@
  */
 
 #include <endian.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include "psplash-fb.h"
 
+/* Length of one refresh in nanoseconds, estimated from the mode timings for
+ * drivers without FBIO_WAITFORVSYNC. Falls back to 60Hz without a pixclock. */
+static long
+psplash_fb_frame_ns (struct fb_var_screeninfo *var)
+{
+  unsigned long long htotal, vtotal;
+
+  htotal = var->xres + var->left_margin + var->right_margin + var->hsync_len;
+  vtotal = var->yres + var->upper_margin + var->lower_margin + var->vsync_len;
+
+  if (var->pixclock == 0 || htotal == 0 || vtotal == 0)
+    return 1000000000L / 60;
+
+  return var->pixclock * htotal * vtotal / 1000;
+}
+
+/* Pans are carried out by a helper thread so that waiting for the vsync does
+ * not hold up the command path. Each byte on vsync_req asks for a pan to
+ * fb_var.yoffset at the next refresh, and the thread signals done_fd once the
+ * new front is on screen. When the driver cannot wait for a vsync, the pans
+ * are paced to one per refresh using the estimated frame length instead. */
+static void *
+psplash_fb_vsync_thread (void *data)
+{
+  PSplashFB *fb = data;
+  struct timespec next = { 0, 0 };
+  uint64_t one = 1;
+  char req;
+
+  while (read (fb->vsync_req[0], &req, 1) == 1)
+    {
+      if (!fb->no_vsync && ioctl (fb->fd, FBIO_WAITFORVSYNC, 0) != 0)
+	{
+	  fprintf(stderr, "Error, FB vsync ioctl failed, pacing flips "
+		  "from the mode timings\n");
+	  fb->no_vsync = 1;
+	}
+
+      if (fb->no_vsync)
+	{
+	  while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME,
+				  &next, NULL) == EINTR)
+	    ;
+	  clock_gettime (CLOCK_MONOTONIC, &next);
+	  next.tv_nsec += fb->frame_ns;
+	  next.tv_sec += next.tv_nsec / 1000000000L;
+	  next.tv_nsec %= 1000000000L;
+	}
+
+      if (ioctl (fb->fd, FBIOPAN_DISPLAY, &fb->fb_var) == -1)
+	fprintf(stderr, "psplash_fb_flip: FBIOPAN_DISPLAY failed\n");
+
+      if (write (fb->done_fd, &one, sizeof(one)) != sizeof(one))
+	perror ("Error signalling fb flip");
+    }
+
+  return NULL;
+}
+
 static void
-psplash_wait_for_vsync(PSplashFB *fb)
+psplash_fb_handle_events (PSplashCanvas *canvas, int wait)
+{
+  PSplashFB *fb = canvas->priv;
+  struct pollfd pfd = { .fd = fb->done_fd, .events = POLLIN };
+  uint64_t count;
+
+  if (!fb->flip_pending)
+    return;
+
+  if (wait)
+    while (poll (&pfd, 1, -1) < 0 && errno == EINTR)
+      ;
+
+  if (read (fb->done_fd, &count, sizeof(count)) != sizeof(count))
+    return;
+
+  fb->flip_pending = 0;
+
+  /* Sync new front to new back, entirely when requested and otherwise
+   * just the areas drawn since the last flip */
+  if (fb->sync_pending) {
+    memcpy(fb->bdata, fb->fdata, fb->canvas.stride * fb->real_height);
+    fb->canvas.n_damage = 0;
+  } else {
+    psplash_canvas_sync_damage(&fb->canvas, fb->bdata, fb->fdata);
+  }
+}
+
+static int
+psplash_fb_flip_pending (PSplashCanvas *canvas)
 {
-  int err = ioctl(fb->fd, FBIO_WAITFORVSYNC, 0);
-  if (err != 0)
-    fprintf(stderr, "Error, FB vsync ioctl [%d]\n", err);
+  PSplashFB *fb = canvas->priv;
+
+  return fb->flip_pending;
 }
 
 static void
@@ -23,11 +113,12 @@ psplash_fb_flip(PSplashCanvas *canvas, int sync)
 {
   PSplashFB *fb = canvas->priv;
   char *tmp;
+  char req = 0;
 
   if (fb->double_buffering) {
 
-    /* Carry out the flip after a vsync */
-    psplash_wait_for_vsync(fb);
+    /* At most one pan is queued, the previous one has to land first */
+    psplash_fb_handle_events(canvas, 1);
 
     /* Switch the current activate area in fb */
     if (fb->fb_var.yoffset == 0 ) {
@@ -35,26 +126,83 @@ psplash_fb_flip(PSplashCanvas *canvas, int sync)
     } else {
       fb->fb_var.yoffset = 0;
     }
-    if (ioctl(fb->fd, FBIOPAN_DISPLAY, &fb->fb_var) == -1 ) {
-      fprintf(stderr, "psplash_fb_flip: FBIOPAN_DISPLAY failed\n");
+
+    if (write (fb->vsync_req[1], &req, 1) != 1) {
+      perror ("Error queueing fb flip");
+      return;
     }
+    fb->flip_pending = 1;
+    fb->sync_pending = sync;
 
-    /* Switch the front and back data pointers */
+    /* Switch the front and back data pointers, the back is synced once the
+     * pan has happened */
     tmp = fb->fdata;
     fb->fdata = fb->bdata;
     fb->bdata = tmp;
     fb->canvas.data = fb->bdata;
+  }
+}
 
-    /* Sync new front to new back when requested */
-    if (sync) {
-      memcpy(fb->bdata, fb->fdata, fb->canvas.stride * fb->real_height);
+/* Start the helper thread that pans the display, double buffering is
+ * disabled when that fails */
+static int
+psplash_fb_start_vsync (PSplashFB *fb)
+{
+  fb->frame_ns = psplash_fb_frame_ns (&fb->fb_var);
+
+  if (pipe2 (fb->vsync_req, O_CLOEXEC) < 0)
+    {
+      perror ("Error creating fb flip pipe");
+      return 0;
     }
-  }
+
+  fb->done_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (fb->done_fd < 0)
+    {
+      perror ("Error creating fb flip eventfd");
+      goto close_req;
+    }
+
+  if (pthread_create (&fb->vsync_thread, NULL,
+		      psplash_fb_vsync_thread, fb) != 0)
+    {
+      fprintf(stderr, "Error starting fb vsync thread\n");
+      goto close_done;
+    }
+
+  fb->vsync_running = 1;
+  fb->canvas.event_fd = fb->done_fd;
+  fb->canvas.handle_events = psplash_fb_handle_events;
+  fb->canvas.flip_pending = psplash_fb_flip_pending;
+  return 1;
+
+ close_done:
+  close (fb->done_fd);
+ close_req:
+  close (fb->vsync_req[0]);
+  close (fb->vsync_req[1]);
+  fb->vsync_req[0] = fb->vsync_req[1] = fb->done_fd = -1;
+  return 0;
 }
 
 void
 psplash_fb_destroy (PSplashFB *fb)
 {
+  if (fb->vsync_running)
+    {
+      psplash_fb_handle_events (&fb->canvas, 1);
+      close (fb->vsync_req[1]);
+      fb->vsync_req[1] = -1;
+      pthread_join (fb->vsync_thread, NULL);
+    }
+
+  if (fb->vsync_req[0] >= 0)
+    close (fb->vsync_req[0]);
+  if (fb->vsync_req[1] >= 0)
+    close (fb->vsync_req[1]);
+  if (fb->done_fd >= 0)
+    close (fb->done_fd);
+
   if (fb->fd >= 0)
     close (fb->fd);
 
@@ -157,7 +305,10 @@ psplash_fb_new (int angle, int fbdev_id)
   memset (fb, 0, sizeof(PSplashFB));
   fb->canvas.priv = fb;
   fb->canvas.flip = psplash_fb_flip;
+  fb->canvas.event_fd = -1;
   fb->fd = -1;
+  fb->vsync_req[0] = fb->vsync_req[1] = -1;
+  fb->done_fd = -1;
 
   if ((fb->fd = open (fbdev, O_RDWR)) < 0)
     {
@@ -288,6 +439,11 @@ psplash_fb_new (int angle, int fbdev_id)
       fb->fdata = fb->data + fb->canvas.stride * fb->canvas.height;
       fb->bdata = fb->data;
     }
+    if (!psplash_fb_start_vsync (fb)) {
+      fprintf(stderr, "warning: double buffering disabled\n");
+      fb->double_buffering = 0;
+      fb->bdata = fb->fdata;
+    }
   } else {
     fb->fdata = fb->data;
     fb->bdata = fb->data;
@@ -331,6 +487,8 @@ psplash_fb_new (int angle, int fbdev_id)
       break;
     }
 
+  psplash_canvas_setup(&fb->canvas);
+
   return fb;
 
  fail:
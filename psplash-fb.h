@@ -11,6 +11,7 @@
 #define _HAVE_PSPLASH_FB_H
 
 #include <linux/fb.h>
+#include <pthread.h>
 #include "psplash-draw.h"
 
 typedef struct PSplashFB
@@ -29,6 +30,16 @@ typedef struct PSplashFB
   char		*bdata;
   char		*fdata;
 
+  /* Pans happen on a helper thread at the next refresh */
+  pthread_t	vsync_thread;
+  int		vsync_running;
+  int		vsync_req[2];
+  int		done_fd;
+  int		no_vsync;
+  long		frame_ns;
+  int		flip_pending;
+  int		sync_pending;
+
   int            fbdev_id;
   int            real_width, real_height;
 }
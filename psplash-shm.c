@@ -0,0 +1,184 @@
+/*
+ * psplash-shm - shared memory progress channel for psplash
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <linux/futex.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include "psplash.h"
+#include "psplash-shm.h"
+
+static void
+psplash_shm_futex (uint32_t *addr, int op, uint32_t val)
+{
+  syscall (SYS_futex, addr, op, val, NULL, NULL, 0);
+}
+
+/* Turns the futex wakeups of the writers into eventfd wakeups the main loop
+ * can wait on together with everything else */
+static void *
+psplash_shm_thread (void *data)
+{
+  PSplashShmChannel *channel = data;
+  uint32_t           wake, now;
+  uint64_t           one = 1;
+
+  wake = __atomic_load_n (&channel->shm->wake, __ATOMIC_ACQUIRE);
+
+  while (!__atomic_load_n (&channel->stop, __ATOMIC_ACQUIRE))
+    {
+      psplash_shm_futex (&channel->shm->wake, FUTEX_WAIT, wake);
+
+      now = __atomic_load_n (&channel->shm->wake, __ATOMIC_ACQUIRE);
+      if (now == wake)
+	continue;
+      wake = now;
+
+      if (write (channel->event_fd, &one, sizeof(one)) != sizeof(one))
+	perror ("Error signalling shm update");
+    }
+
+  return NULL;
+}
+
+PSplashShmChannel *
+psplash_shm_new (void)
+{
+  PSplashShmChannel *channel;
+  int                fd;
+
+  if ((channel = calloc (1, sizeof(PSplashShmChannel))) == NULL)
+    {
+      perror ("Error no memory");
+      return NULL;
+    }
+  channel->event_fd = -1;
+
+  fd = open (PSPLASH_SHM, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+	     S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+  if (fd < 0 || ftruncate (fd, sizeof(PSplashShm)) < 0)
+    {
+      perror ("Error creating " PSPLASH_SHM);
+      goto fail;
+    }
+
+  channel->shm = mmap (NULL, sizeof(PSplashShm), PROT_READ | PROT_WRITE,
+		       MAP_SHARED, fd, 0);
+  close (fd);
+  fd = -1;
+
+  if (channel->shm == MAP_FAILED)
+    {
+      perror ("Error mapping " PSPLASH_SHM);
+      channel->shm = NULL;
+      goto fail;
+    }
+
+  channel->event_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (channel->event_fd < 0)
+    {
+      perror ("Error creating shm eventfd");
+      goto fail;
+    }
+
+  if (pthread_create (&channel->thread, NULL,
+		      psplash_shm_thread, channel) != 0)
+    {
+      fprintf (stderr, "Error starting shm thread\n");
+      goto fail;
+    }
+
+  /* Writers check the magic, so only publish it once we listen */
+  __atomic_store_n (&channel->shm->magic, PSPLASH_SHM_MAGIC,
+		    __ATOMIC_RELEASE);
+
+  return channel;
+
+ fail:
+  if (fd >= 0)
+    close (fd);
+  if (channel->event_fd >= 0)
+    close (channel->event_fd);
+  if (channel->shm)
+    munmap (channel->shm, sizeof(PSplashShm));
+  unlink (PSPLASH_SHM);
+  free (channel);
+  return NULL;
+}
+
+void
+psplash_shm_destroy (PSplashShmChannel *channel)
+{
+  /* Writers still holding the segment see psplash is gone */
+  __atomic_store_n (&channel->shm->magic, 0, __ATOMIC_RELEASE);
+
+  __atomic_store_n (&channel->stop, 1, __ATOMIC_RELEASE);
+  __atomic_add_fetch (&channel->shm->wake, 1, __ATOMIC_RELEASE);
+  psplash_shm_futex (&channel->shm->wake, FUTEX_WAKE, 1);
+  pthread_join (channel->thread, NULL);
+
+  close (channel->event_fd);
+  munmap (channel->shm, sizeof(PSplashShm));
+  unlink (PSPLASH_SHM);
+  free (channel);
+}
+
+int
+psplash_shm_read (PSplashShmChannel *channel, int *progress,
+		  char *msg, size_t len)
+{
+  PSplashShm *shm = channel->shm;
+  uint32_t    seq, progress_seq, msg_seq;
+  uint64_t    count;
+  int         value, tries, changed = 0;
+  char        text[PSPLASH_SHM_MSG_MAX];
+
+  if (read (channel->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    perror ("Error reading shm eventfd");
+
+  /* Clear pending first, so an update made while we read wakes us again */
+  __atomic_store_n (&shm->pending, 0, __ATOMIC_SEQ_CST);
+
+  for (tries = 0; tries < PSPLASH_SHM_RETRIES; tries++)
+    {
+      seq = __atomic_load_n (&shm->seq, __ATOMIC_ACQUIRE);
+      if (seq & 1)
+	{
+	  sched_yield ();
+	  continue;
+	}
+
+      progress_seq = shm->progress_seq;
+      value = shm->progress;
+      msg_seq = shm->msg_seq;
+      memcpy (text, shm->msg, sizeof(text));
+
+      __atomic_thread_fence (__ATOMIC_ACQUIRE);
+      if (__atomic_load_n (&shm->seq, __ATOMIC_RELAXED) == seq)
+	break;
+    }
+
+  if (tries == PSPLASH_SHM_RETRIES || seq == channel->seq)
+    return 0;
+  channel->seq = seq;
+
+  if (progress_seq != channel->progress_seq)
+    {
+      channel->progress_seq = progress_seq;
+      *progress = value;
+      changed |= PSPLASH_SHM_PROGRESS;
+    }
+
+  if (msg_seq != channel->msg_seq)
+    {
+      channel->msg_seq = msg_seq;
+      text[sizeof(text) - 1] = '\0';
+      snprintf (msg, len, "%s", text);
+      changed |= PSPLASH_SHM_MSG;
+    }
+
+  return changed;
+}
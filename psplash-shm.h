@@ -0,0 +1,73 @@
+/*
+ * psplash-shm - shared memory progress channel for psplash
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#ifndef _HAVE_PSPLASH_SHM_H
+#define _HAVE_PSPLASH_SHM_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define PSPLASH_SHM "psplash.shm"
+#define PSPLASH_SHM_MAGIC 0x48535350 /* "PSSH" */
+#define PSPLASH_SHM_MSG_MAX 256
+
+/* How often a reader or writer retries before giving up on a writer that
+ * never finishes its update, for instance because it was killed */
+#define PSPLASH_SHM_RETRIES 1000
+
+/* The segment psplash publishes next to its FIFO. Writers update it under
+ * the seqlock in seq, which is odd while an update is in progress, and bump
+ * the counter of each field they change. A writer that finds pending clear
+ * sets it and wakes psplash through the futex in wake; psplash clears it
+ * when it reads the segment, so at most one wakeup is issued per frame no
+ * matter how often the progress changes. */
+typedef struct PSplashShm
+{
+  uint32_t magic;
+  uint32_t seq;
+  uint32_t pending;
+  uint32_t wake;
+  uint32_t progress_seq;
+  int32_t  progress;
+  uint32_t msg_seq;
+  char     msg[PSPLASH_SHM_MSG_MAX];
+}
+PSplashShm;
+
+/* psplash's end of the channel */
+typedef struct PSplashShmChannel
+{
+  PSplashShm *shm;
+  int         event_fd;
+  pthread_t   thread;
+  int         stop;
+  uint32_t    seq;
+  uint32_t    progress_seq;
+  uint32_t    msg_seq;
+}
+PSplashShmChannel;
+
+#define PSPLASH_SHM_PROGRESS (1 << 0)
+#define PSPLASH_SHM_MSG      (1 << 1)
+
+/* Creates PSPLASH_SHM in the current directory. event_fd becomes readable
+ * when a writer signalled an update. */
+PSplashShmChannel *
+psplash_shm_new (void);
+
+void
+psplash_shm_destroy (PSplashShmChannel *channel);
+
+/* Reads the latest consistent snapshot, returning the PSPLASH_SHM_ flags of
+ * the fields changed since the last read */
+int
+psplash_shm_read (PSplashShmChannel *channel, int *progress,
+		  char *msg, size_t len);
+
+/* The writer side, setting the progress and the message, lives in the
+ * client library, see psplash_client_progress() and psplash_client_msg() */
+
+#endif
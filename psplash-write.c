@@ -9,40 +9,89 @@
  *
  */
 
-#include <string.h>
-#include <unistd.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <errno.h>
+#include <poll.h>
 #include "psplash.h"
+#include "psplash-client.h"
 
-int main(int argc, char **argv)
+static void
+usage (const char *name)
+{
+  fprintf(stderr,
+	  "Usage: %s <command> [<command>...]\n"
+	  "       %s -    (newline separated commands from stdin)\n",
+	  name, name);
+  exit(-1);
+}
+
+/* Streams commands from stdin over one connection. Whatever has arrived
+ * by the time stdin runs dry is sent in one go. Lines too long to send are
+ * skipped with a warning. */
+static int
+psplash_write_stdin (PSplashClient *client)
 {
-  char   *rundir;
-  int     pipe_fd;
-  size_t  count;
-  ssize_t written;
+  struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+  char          buf[PSPLASH_CMD_MAX];
+  char         *line, *nl;
+  size_t        len = 0;
+  ssize_t       ret;
+  int           skip = 0;
+
+  while ((ret = read(STDIN_FILENO, buf + len, sizeof(buf) - 1 - len)) != 0)
+    {
+      if (ret < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return -1;
+	}
+      len += ret;
+      buf[len] = '\0';
 
-  rundir = getenv("PSPLASH_FIFO_DIR");
+      for (line = buf; (nl = strchr(line, '\n')) != NULL; line = nl + 1)
+	{
+	  *nl = '\0';
+	  if (skip)
+	    skip = 0;
+	  else if (*line && psplash_client_send(client, line))
+	    return -1;
+	}
 
-  if (!rundir)
-    rundir = "/run";
+      /* Keep a partial line for the next read. One that fills the buffer
+       * is longer than a command can be, drop it up to its newline. */
+      len -= line - buf;
+      if (len == sizeof(buf) - 1)
+	{
+	  if (!skip)
+	    fprintf(stderr, "Skipping command longer than %d bytes\n",
+		    PSPLASH_CMD_MAX - 2);
+	  skip = 1;
+	  len = 0;
+	}
+      memmove(buf, line, len);
 
-  if (argc!=2)
+      if (poll(&pfd, 1, 0) == 0 && psplash_client_flush(client))
+	return -1;
+    }
+
+  buf[len] = '\0';
+  if (len && !skip && psplash_client_send(client, buf))
+    return -1;
+
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  PSplashClient *client;
+  int            i, ret = 0;
+
+  if (argc < 2)
     {
       fprintf(stderr, "Wrong number of arguments\n");
-      exit(-1);
+      usage(argv[0]);
     }
 
-  if (chdir(rundir)) {
-    perror("chdir");
-    exit(-1);
-  }
-
-  if ((pipe_fd = open (PSPLASH_FIFO,O_WRONLY|O_NONBLOCK)) == -1)
+  if ((client = psplash_client_open(NULL)) == NULL)
     {
       /* Silently error out instead of covering the boot process in
          errors when psplash has exitted due to a VC switch */
@@ -50,16 +99,17 @@ int main(int argc, char **argv)
       exit (-1);
     }
 
-  count = strlen(argv[1]) + 1;
-  written = write(pipe_fd, argv[1], count);
-  if (written == -1) {
-    perror("write");
-    exit(-1);
-  } else if ((size_t)written < count) {
-    fprintf(stderr, "Wrote %zd bytes, less then expected %zu bytes\n",
-      written, count);
-    exit(-1);
-  }
+  if (argc == 2 && !strcmp(argv[1], "-"))
+    ret = psplash_write_stdin(client);
+  else
+    for (i = 1; i < argc && !ret; i++)
+      ret = psplash_client_send(client, argv[i]);
+
+  if (psplash_client_close(client) || ret)
+    {
+      perror("write");
+      exit(-1);
+    }
 
   return 0;
 }
@@ -12,6 +12,7 @@
 
 #include "psplash.h"
 #include "psplash-fb.h"
+#include "psplash-shm.h"
 #ifdef ENABLE_DRM
 #include "psplash-drm.h"
 #endif
@@ -45,27 +46,29 @@ psplash_exit (int UNUSED(signum))
 void
 psplash_draw_msg(PSplashCanvas *canvas, const char *msg)
 {
-  int w, h;
+  PSplashTextLayout *layout;
 
-  psplash_text_size(&w, &h, &FONT_DEF, msg);
+  if ((layout = psplash_text_layout_new(&FONT_DEF, msg)) == NULL)
+    return;
 
-  DBG("displaying '%s' %ix%i\n", msg, w, h);
+  DBG("displaying '%s' %ix%i\n", msg, layout->width, layout->height);
 
   /* Clear */
 
   psplash_draw_rect(canvas,
 			0,
-			SPLIT_LINE_POS(canvas) - h,
+			SPLIT_LINE_POS(canvas) - layout->height,
 			canvas->width,
-			h,
+			layout->height,
 			PSPLASH_BACKGROUND_COLOR);
 
-  psplash_draw_text(canvas,
-			(canvas->width-w)/2,
-			SPLIT_LINE_POS(canvas) - h,
-			PSPLASH_TEXT_COLOR,
-			&FONT_DEF,
-			msg);
+  psplash_text_layout_draw(canvas,
+			layout,
+			(canvas->width - layout->width)/2,
+			SPLIT_LINE_POS(canvas) - layout->height,
+			PSPLASH_TEXT_COLOR);
+
+  psplash_text_layout_free(layout);
 }
 
 #ifdef PSPLASH_SHOW_PROGRESS_BAR
@@ -105,24 +108,99 @@ psplash_draw_progress(PSplashCanvas *canvas, int value)
 }
 #endif /* PSPLASH_SHOW_PROGRESS_BAR */
 
+static void
+psplash_draw_scene(PSplashCanvas *canvas, PSplashImage *logo,
+		   PSplashImage *bar)
+{
+  /* Clear the background with #ecece1 */
+  psplash_draw_rect(canvas, 0, 0, canvas->width, canvas->height,
+                        PSPLASH_BACKGROUND_COLOR);
+
+  /* Draw the Poky logo  */
+  psplash_image_draw(canvas, logo,
+			 (canvas->width  - POKY_IMG_WIDTH)/2,
+#if PSPLASH_IMG_FULLSCREEN
+			 (canvas->height - POKY_IMG_HEIGHT)/2);
+#else
+			 (canvas->height * PSPLASH_IMG_SPLIT_NUMERATOR
+			  / PSPLASH_IMG_SPLIT_DENOMINATOR - POKY_IMG_HEIGHT)/2);
+#endif
+
+#ifdef PSPLASH_SHOW_PROGRESS_BAR
+  /* Draw progress bar border */
+  psplash_image_draw(canvas, bar,
+			 (canvas->width  - BAR_IMG_WIDTH)/2,
+			 SPLIT_LINE_POS(canvas));
+
+  psplash_draw_progress(canvas, 0);
+#else
+  (void)bar;
+#endif
+
+#ifdef PSPLASH_STARTUP_MSG
+  psplash_draw_msg(canvas, PSPLASH_STARTUP_MSG);
+#endif
+}
+
+/* Why psplash_main() returned. The quit codes are those of the QUIT and
+ * QUIT KEEP commands, only these leave the splash on screen. */
+#define PSPLASH_EXIT_ERROR   -1
+#define PSPLASH_EXIT_QUIT     1
+#define PSPLASH_EXIT_KEEP     2
+#define PSPLASH_EXIT_SIGNAL   3
+#define PSPLASH_EXIT_TIMEOUT  4
+
+/* What the commands of one wakeup left to draw. Only the last message and
+ * progress value matter, so a burst of commands is drawn and flipped once. */
+typedef struct PSplashUpdate
+{
+  char  msg[PSPLASH_CMD_MAX];
+  int   have_msg;
+  int   progress;
+  int   have_progress;
+  int   ack;
+}
+PSplashUpdate;
+
+/* A client connected to the control socket. Each message it sends holds one
+ * or more commands. Once it has sent an ACK command, every message, starting
+ * with the one holding it, is answered with "OK <seconds>.<nanoseconds>",
+ * the CLOCK_MONOTONIC time by which the frame showing its commands was on
+ * screen. */
+typedef struct PSplashConnection
+{
+  struct PSplashConnection *next;
+  int                       fd;
+  int                       acks;
+  int                       acks_pending;
+  int                       acks_queued;
+}
+PSplashConnection;
+
 static int
-parse_command(PSplashCanvas *canvas, char *string)
+parse_command(PSplashUpdate *update, char *string)
 {
   char *command;
 
   DBG("got cmd %s", string);
 
   if (strcmp(string,"QUIT") == 0)
-    return 1;
+    return PSPLASH_EXIT_QUIT;
 
   command = strtok(string," ");
 
+  if (!command)
+    return 0;
+
   if (!strcmp(command,"MSG"))
     {
       char *arg = strtok(NULL, "\0");
 
       if (arg)
-        psplash_draw_msg(canvas, arg);
+        {
+          snprintf(update->msg, sizeof(update->msg), "%s", arg);
+          update->have_msg = 1;
+        }
     }
  #ifdef PSPLASH_SHOW_PROGRESS_BAR
   else  if (!strcmp(command,"PROGRESS"))
@@ -130,100 +208,528 @@ parse_command(PSplashCanvas *canvas, char *string)
       char *arg = strtok(NULL, "\0");
 
       if (arg)
-        psplash_draw_progress(canvas, atoi(arg));
+        {
+          update->progress = atoi(arg);
+          update->have_progress = 1;
+        }
     }
 #endif
+  else if (!strcmp(command,"ACK"))
+    {
+      /* Only means something on the control socket */
+      update->ack = 1;
+    }
   else if (!strcmp(command,"QUIT"))
     {
+      char *arg = strtok(NULL, "\0");
+
+      /* QUIT KEEP leaves the splash on screen for whatever comes next */
+      if (arg && !strcmp(arg, "KEEP"))
+        return PSPLASH_EXIT_KEEP;
+
+      return PSPLASH_EXIT_QUIT;
+    }
+
+  return 0;
+}
+
+/* Parses the newline or NUL separated commands in buf, which has to be NUL
+ * terminated at length. Returns the quit code of a QUIT among them. */
+static int
+parse_commands(PSplashUpdate *update, char *buf, ssize_t length)
+{
+  char *cmd = buf;
+  int   quit;
+
+  while (length > 0)
+    {
+      int cmdlen;
+      char *cmdend = memchr(cmd, '\n', length);
+
+      /* Replace newlines with string termination */
+      if (cmdend)
+        *cmdend = '\0';
+
+      cmdlen = strnlen(cmd, length);
+
+      /* Skip string terminations */
+      if (!cmdlen)
+        {
+          length--;
+          cmd++;
+          continue;
+        }
+
+      if ((quit = parse_command(update, cmd)))
+        return quit;
+
+      length -= cmdlen;
+      cmd += cmdlen;
+    }
+
+  return 0;
+}
+
+/* Returns TRUE while a canvas still waits for a flip to complete */
+static int
+psplash_flip_pending(PSplashCanvas *canvas)
+{
+  PSplashCanvas *c;
+
+  for (c = canvas; c; c = c->next)
+    if (c->flip_pending && c->flip_pending(c))
+      return TRUE;
+
+  return FALSE;
+}
+
+/* Draws and flips the update. While a flip is pending the buffers can't be
+ * drawn into, so the update is left for when event_fd reports the flip
+ * done, gathering what arrives in the meantime. Returns FALSE if so. */
+static int
+psplash_draw_update(PSplashCanvas *canvas, PSplashUpdate *update)
+{
+  PSplashCanvas *c;
+
+  if (!update->have_msg && !update->have_progress)
+    return TRUE;
+
+  if (psplash_flip_pending(canvas))
+    return FALSE;
+
+  for (c = canvas; c; c = c->next)
+    {
+      if (update->have_msg)
+        psplash_draw_msg(c, update->msg);
+#ifdef PSPLASH_SHOW_PROGRESS_BAR
+      if (update->have_progress)
+        psplash_draw_progress(c, update->progress);
+#endif
+      c->flip(c, 0);
+    }
+
+  update->have_msg = 0;
+  update->have_progress = 0;
+
+  return TRUE;
+}
+
+/* Reads and handles the pending signals, returns 1 if told to exit */
+static int
+psplash_handle_signals(int signal_fd)
+{
+  struct signalfd_siginfo info;
+
+  while (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+    {
+      /* VT switches are acknowledged here rather than in a handler */
+      if (info.ssi_signo == SIGUSR1)
+	{
+	  psplash_console_vt_request();
+	  continue;
+	}
+
+      psplash_exit(info.ssi_signo);
       return 1;
     }
 
-  canvas->flip(canvas, 0);
   return 0;
 }
 
-void
-psplash_main(PSplashCanvas *canvas, int pipe_fd, int timeout)
+static int
+psplash_watch(int epoll_fd, int fd)
+{
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+
+  /* Canvases on the same device share their event fd */
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0 && errno != EEXIST)
+    {
+      perror("Error watching fd");
+      return -1;
+    }
+
+  return 0;
+}
+
+/* Reads the FIFO. Writes up to PIPE_BUF bytes are atomic, so a command can
+ * only be cut off by a read that filled the buffer. Then the bytes after the
+ * last complete command are kept in buf, pending bytes long, for the next
+ * read to complete; any other read is parsed whole, as before. Returns the
+ * quit code of a QUIT among the parsed commands. */
+static int
+psplash_fifo_read(int pipe_fd, char *buf, size_t size, size_t *pending,
+		  PSplashUpdate *update)
 {
-  int            err;
-  ssize_t        length = 0;
-  fd_set         descriptors;
-  struct timeval tv;
-  char          *end;
-  char          *cmd;
-  char           command[2048];
+  ssize_t length, end;
+  int     full, quit;
+
+  length = read(pipe_fd, buf + *pending, size - 1 - *pending);
+  if (length <= 0)
+    return 0;
+
+  full = (size_t)length == size - 1 - *pending;
+  length += *pending;
+  end = length;
+
+  if (full)
+    while (end > 0 && buf[end - 1] != '\n' && buf[end - 1] != '\0')
+      end--;
 
-  tv.tv_sec = timeout;
-  tv.tv_usec = 0;
+  if (end > 0 && end < length)
+    {
+      buf[end - 1] = '\0';
+      quit = parse_commands(update, buf, end - 1);
+    }
+  else
+    {
+      /* Complete, or a single command filling the whole buffer */
+      buf[length] = '\0';
+      quit = parse_commands(update, buf, length);
+      end = length;
+    }
+
+  *pending = length - end;
+  memmove(buf, buf + end, *pending);
 
-  FD_ZERO(&descriptors);
-  FD_SET(pipe_fd, &descriptors);
+  return quit;
+}
 
-  end = command;
+/* Reads the pending messages of a client, returns the quit code of a QUIT
+ * among them. A client that hung up is left with an fd of -1. */
+static int
+psplash_conn_read(PSplashConnection *client, PSplashUpdate *update)
+{
+  char    buf[PSPLASH_CMD_MAX];
+  ssize_t length;
+  int     quit;
 
   while (1)
     {
-      if (timeout != 0)
-	err = select(pipe_fd+1, &descriptors, NULL, NULL, &tv);
-      else
-	err = select(pipe_fd+1, &descriptors, NULL, NULL, NULL);
+      length = recv(client->fd, buf, sizeof(buf) - 1, 0);
+
+      if (length < 0 && (errno == EAGAIN || errno == EINTR))
+	return 0;
+
+      if (length <= 0)
+	{
+	  close(client->fd);
+	  client->fd = -1;
+	  return 0;
+	}
+
+      buf[length] = '\0';
+
+      update->ack = 0;
+      quit = parse_commands(update, buf, length);
+
+      /* The reply is sent once the whole message has been drawn */
+      if (update->ack)
+	client->acks = 1;
 
-      if (err <= 0)
+      if (client->acks)
+	client->acks_pending++;
+
+      if (quit)
+	return quit;
+    }
+}
+
+/* Accepts the pending connections and reads what they already sent, in the
+ * order they connected, so the commands of clients run one after the other
+ * are applied in that order. Returns the quit code of a QUIT among them. */
+static int
+psplash_conn_accept(int epoll_fd, int listen_fd, PSplashConnection **clients,
+		    PSplashUpdate *update)
+{
+  PSplashConnection *client;
+  int                fd, quit = 0;
+
+  while (!quit && (fd = accept4(listen_fd, NULL, NULL,
+				SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+    {
+      if ((client = calloc(1, sizeof(PSplashConnection))) == NULL
+	  || psplash_watch(epoll_fd, fd))
+	{
+	  free(client);
+	  close(fd);
+	  continue;
+	}
+
+      client->fd = fd;
+      client->next = *clients;
+      *clients = client;
+
+      quit = psplash_conn_read(client, update);
+    }
+
+  return quit;
+}
+
+/* Answers the clients waiting for an ack once what was drawn is on screen,
+ * one reply for each of their messages, and drops the clients that hung up.
+ * Messages whose commands were drawn, or left nothing to draw, are queued
+ * for the flip showing them and answered once no flip is pending. */
+static void
+psplash_conn_flush(PSplashCanvas *canvas, PSplashConnection **clients,
+		   int drawn)
+{
+  PSplashConnection **link, *client;
+  struct timespec     now;
+  char                ack[32];
+  int                 shown = !psplash_flip_pending(canvas);
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  snprintf(ack, sizeof(ack), "OK %lld.%09ld",
+	   (long long)now.tv_sec, now.tv_nsec);
+
+  for (link = clients; (client = *link) != NULL; )
+    {
+      if (drawn)
+	{
+	  client->acks_queued += client->acks_pending;
+	  client->acks_pending = 0;
+	}
+
+      /* Replies that don't fit the socket wait for the next round */
+      if (client->fd >= 0 && shown)
+	while (client->acks_queued
+	       && send(client->fd, ack, strlen(ack) + 1, MSG_NOSIGNAL) > 0)
+	  client->acks_queued--;
+
+      if (client->fd < 0)
+	{
+	  *link = client->next;
+	  free(client);
+	  continue;
+	}
+
+      link = &client->next;
+    }
+}
+
+static void
+psplash_conn_free_all(PSplashConnection *clients)
+{
+  PSplashConnection *next;
+
+  for (; clients; clients = next)
+    {
+      next = clients->next;
+      if (clients->fd >= 0)
+	close(clients->fd);
+      free(clients);
+    }
+}
+
+/* Waits on the FIFO, the control socket and its clients, the shared memory
+ * channel, the presentation events of the canvases, signals and the timeout
+ * through a single epoll set.
+ * The FIFO is kept open for writing by a dummy writer, so it never reports
+ * EOF between clients. The commands gathered from all sources in one wakeup
+ * are drawn with a single flip.
+ *
+ * Returns the PSPLASH_EXIT_ code of the reason it stopped */
+int
+psplash_main(PSplashCanvas *canvas, int pipe_fd, int listen_fd,
+	     PSplashShmChannel *shm, int signal_fd, int timeout)
+{
+  int            quit = PSPLASH_EXIT_ERROR;
+  PSplashCanvas *c;
+  PSplashConnection *clients = NULL, *client;
+  PSplashUpdate  update;
+  int            epoll_fd, timer_fd = -1;
+  int            i, n, shm_ready = 0, drawn;
+  struct epoll_event events[8];
+  struct itimerspec  timer;
+  char           command[PSPLASH_CMD_MAX];
+  size_t         pending = 0;
+
+  memset(&update, 0, sizeof(update));
+  memset(&timer, 0, sizeof(timer));
+  timer.it_value.tv_sec = timeout;
+
+  if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    {
+      perror("Error creating epoll set");
+      return PSPLASH_EXIT_ERROR;
+    }
+
+  if (psplash_watch(epoll_fd, pipe_fd) || psplash_watch(epoll_fd, signal_fd))
+    goto out;
+
+  if (listen_fd >= 0 && psplash_watch(epoll_fd, listen_fd))
+    goto out;
+
+  if (shm && psplash_watch(epoll_fd, shm->event_fd))
+    goto out;
+
+  for (c = canvas; c; c = c->next)
+    if (c->event_fd >= 0 && psplash_watch(epoll_fd, c->event_fd))
+      goto out;
+
+  if (timeout != 0)
+    {
+      timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+      if (timer_fd < 0)
+	{
+	  perror("Error creating timer");
+	  goto out;
+	}
+      if (psplash_watch(epoll_fd, timer_fd))
+	goto out;
+      timerfd_settime(timer_fd, 0, &timer, NULL);
+    }
+
+  quit = 0;
+  while (!quit)
+    {
+      n = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]), -1);
+
+      if (n < 0)
 	{
-	  /*
 	  if (errno == EINTR)
 	    continue;
-	  */
-	  return;
+	  perror("Error waiting for events");
+	  quit = PSPLASH_EXIT_ERROR;
+	  goto out;
 	}
 
-      length += read (pipe_fd, end, sizeof(command) - (end - command));
+      for (i = 0; i < n && !quit; i++)
+	{
+	  int fd = events[i].data.fd;
+
+	  if (fd == timer_fd)
+	    {
+	      quit = PSPLASH_EXIT_TIMEOUT;
+	      goto out;
+	    }
+
+	  if (fd == signal_fd)
+	    {
+	      if (psplash_handle_signals(signal_fd))
+		{
+		  quit = PSPLASH_EXIT_SIGNAL;
+		  goto out;
+		}
+	    }
+	  else if (fd == pipe_fd)
+	    {
+	      quit = psplash_fifo_read(pipe_fd, command, sizeof(command),
+				       &pending, &update);
+	    }
+	  else if (fd == listen_fd)
+	    {
+	      quit = psplash_conn_accept(epoll_fd, listen_fd, &clients,
+					 &update);
+	    }
+	  else if (shm && fd == shm->event_fd)
+	    {
+	      shm_ready = 1;
+	    }
+	  else
+	    {
+	      for (client = clients; client; client = client->next)
+		if (client->fd == fd)
+		  break;
+
+	      if (client)
+		{
+		  quit = psplash_conn_read(client, &update);
+		  continue;
+		}
+
+	      /* Presentation events, such as completed page flips */
+	      for (c = canvas; c; c = c->next)
+		if (c->event_fd == fd)
+		  {
+		    c->handle_events(c, 0);
+		    break;
+		  }
+	    }
+	}
 
-      if (length == 0)
+      /* Clients send their queued commands before updating the segment,
+       * so it holds the newest values and goes last */
+      if (shm_ready)
 	{
-	  /* Reopen to see if there's anything more for us */
-	  close(pipe_fd);
-	  pipe_fd = open(PSPLASH_FIFO,O_RDONLY|O_NONBLOCK);
-	  goto out;
+	  int flags, value = 0;
+
+	  flags = psplash_shm_read(shm, &value, update.msg,
+				   sizeof(update.msg));
+	  if (flags & PSPLASH_SHM_MSG)
+	    update.have_msg = 1;
+#ifdef PSPLASH_SHOW_PROGRESS_BAR
+	  if (flags & PSPLASH_SHM_PROGRESS)
+	    {
+	      update.progress = value;
+	      update.have_progress = 1;
+	    }
+#endif
+	  shm_ready = 0;
 	}
 
-      cmd = command;
-      do {
-	int cmdlen;
-        char *cmdend = memchr(cmd, '\n', length);
+      /* Everything read in this wakeup is drawn with a single flip, or
+       * with the next wakeup after the pending one completes. What came
+       * before a QUIT is drawn too, it may be kept on screen. */
+      drawn = psplash_draw_update(canvas, &update);
+      if (quit && !drawn)
+	{
+	  for (c = canvas; c; c = c->next)
+	    if (c->handle_events)
+	      c->handle_events(c, 1);
+	  drawn = psplash_draw_update(canvas, &update);
+	}
+      psplash_conn_flush(canvas, &clients, drawn);
 
-        /* Replace newlines with string termination */
-        if (cmdend)
-            *cmdend = '\0';
+      if (timer_fd >= 0)
+	timerfd_settime(timer_fd, 0, &timer, NULL);
+    }
 
-        cmdlen = strnlen(cmd, length);
+ out:
+  psplash_conn_free_all(clients);
+  if (timer_fd >= 0)
+    close(timer_fd);
+  close(epoll_fd);
 
-        /* Skip string terminations */
-	if (!cmdlen && length)
-          {
-            length--;
-            cmd++;
-	    continue;
-          }
+  return quit;
+}
 
-	if (parse_command(canvas, cmd))
-	  return;
+/* Opens the control socket next to the FIFO. The splash still works through
+ * the FIFO alone when this fails. */
+static int
+psplash_listen(void)
+{
+  struct sockaddr_un addr;
+  int                fd;
 
-	length -= cmdlen;
-	cmd += cmdlen;
-      } while (length);
+  if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		   0)) < 0)
+    {
+      perror("Error creating control socket");
+      return -1;
+    }
 
-    out:
-      end = &command[length];
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, PSPLASH_SOCKET, sizeof(addr.sun_path) - 1);
 
-      tv.tv_sec = timeout;
-      tv.tv_usec = 0;
+  unlink(PSPLASH_SOCKET);
 
-      FD_ZERO(&descriptors);
-      FD_SET(pipe_fd,&descriptors);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+      || chmod(PSPLASH_SOCKET, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP) < 0
+      || listen(fd, SOMAXCONN) < 0)
+    {
+      perror("Error setting up control socket");
+      close(fd);
+      unlink(PSPLASH_SOCKET);
+      return -1;
     }
 
-  return;
+  return fd;
 }
 
 int
@@ -234,13 +740,24 @@ main (int argc, char** argv)
   PSplashFB *fb = NULL;
 #ifdef ENABLE_DRM
   PSplashDRM *drm = NULL;
+  int        drm_bpp = PSPLASH_DRM_BPP, drm_flags = 0;
 #endif
-  PSplashCanvas *canvas;
+  int        dummy_fd, signal_fd, listen_fd;
+  PSplashShmChannel *shm;
+  sigset_t   signals;
+  PSplashCanvas *canvas, *layer, *c;
+  PSplashImage  *logo = NULL, *bar = NULL;
   bool       disable_console_switch = FALSE;
+  bool       keep = FALSE;
 
-  signal(SIGHUP, psplash_exit);
-  signal(SIGINT, psplash_exit);
-  signal(SIGQUIT, psplash_exit);
+  /* Signals are read from a signalfd in the main loop. They are blocked
+   * before any helper thread is started so that none of them gets one. */
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGHUP);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGQUIT);
+  sigaddset(&signals, SIGUSR1);
+  sigprocmask(SIG_BLOCK, &signals, NULL);
 
   while (++i < argc) {
     if (!strcmp(argv[i],"-n") || !strcmp(argv[i],"--no-console-switch"))
@@ -249,6 +766,12 @@ main (int argc, char** argv)
         continue;
       }
 
+    if (!strcmp(argv[i],"-k") || !strcmp(argv[i],"--keep"))
+      {
+        keep = TRUE;
+        continue;
+      }
+
     if (!strcmp(argv[i],"-a") || !strcmp(argv[i],"--angle"))
       {
         if (++i >= argc) goto fail;
@@ -269,6 +792,23 @@ main (int argc, char** argv)
         use_drm = 1;
         continue;
     }
+
+    if (!strcmp(argv[i], "--drm-bpp"))
+      {
+        if (++i >= argc) goto fail;
+        drm_bpp = atoi(argv[i]);
+        continue;
+      }
+
+    if (!strcmp(argv[i], "--drm-takeover")) {
+        drm_flags |= PSPLASH_DRM_TAKEOVER;
+        continue;
+    }
+
+    if (!strcmp(argv[i], "--drm-single-buffer")) {
+        drm_flags |= PSPLASH_DRM_SINGLE_BUFFER;
+        continue;
+    }
 #endif
 #ifdef ENABLE_DRM_LEASE
     if (!strcmp(argv[i],"--drm-lease"))
@@ -282,7 +822,7 @@ main (int argc, char** argv)
 
     fail:
       fprintf(stderr,
-              "Usage: %s [-n|--no-console-switch][-a|--angle <0|90|180|270>][-f|--fbdev|-d|--dev <0..9>][--drm]\n",
+              "Usage: %s [-n|--no-console-switch][-k|--keep][-a|--angle <0|90|180|270>][-f|--fbdev|-d|--dev <0..9>][--drm][--drm-bpp <16|32>][--drm-takeover][--drm-single-buffer]\n",
               argv[0]);
       exit(-1);
   }
@@ -314,12 +854,31 @@ main (int argc, char** argv)
       exit(-2);
     }
 
+  /* Hold a writer open ourselves so the FIFO never reports EOF when a
+   * client closes it */
+  if ((dummy_fd = open (PSPLASH_FIFO,O_WRONLY|O_NONBLOCK)) == -1)
+    {
+      perror("pipe open");
+      exit(-2);
+    }
+
+  if ((signal_fd = signalfd(-1, &signals, SFD_NONBLOCK|SFD_CLOEXEC)) == -1)
+    {
+      perror("signalfd");
+      exit(-2);
+    }
+
+  listen_fd = psplash_listen();
+
+  /* High rate progress sources write to shared memory instead */
+  shm = psplash_shm_new();
+
   if (!disable_console_switch)
     psplash_console_switch ();
 
   if (use_drm) {
 #ifdef ENABLE_DRM
-    if ((drm = psplash_drm_new(angle, dev_id)) == NULL) {
+    if ((drm = psplash_drm_new(angle, dev_id, drm_bpp, drm_flags)) == NULL) {
       ret = -1;
       goto error;
     }
@@ -337,42 +896,29 @@ main (int argc, char** argv)
   sd_notify(0, "READY=1");
 #endif
 
-  /* Clear the background with #ecece1 */
-  psplash_draw_rect(canvas, 0, 0, canvas->width, canvas->height,
-                        PSPLASH_BACKGROUND_COLOR);
-
-  /* Draw the Poky logo  */
-  psplash_draw_image(canvas,
-			 (canvas->width  - POKY_IMG_WIDTH)/2,
-#if PSPLASH_IMG_FULLSCREEN
-			 (canvas->height - POKY_IMG_HEIGHT)/2,
-#else
-			 (canvas->height * PSPLASH_IMG_SPLIT_NUMERATOR
-			  / PSPLASH_IMG_SPLIT_DENOMINATOR - POKY_IMG_HEIGHT)/2,
-#endif
-			 POKY_IMG_WIDTH,
-			 POKY_IMG_HEIGHT,
-			 POKY_IMG_BYTES_PER_PIXEL,
-			 POKY_IMG_ROWSTRIDE,
-			 POKY_IMG_RLE_PIXEL_DATA);
-
+  /* Convert the images to the canvas format once, every draw after that
+   * is a plain copy. All canvases share the format. */
+  logo = psplash_image_new(canvas,
+			   POKY_IMG_WIDTH,
+			   POKY_IMG_HEIGHT,
+			   POKY_IMG_BYTES_PER_PIXEL,
+			   POKY_IMG_ROWSTRIDE,
+			   POKY_IMG_RLE_PIXEL_DATA);
 #ifdef PSPLASH_SHOW_PROGRESS_BAR
-  /* Draw progress bar border */
-  psplash_draw_image(canvas,
-			 (canvas->width  - BAR_IMG_WIDTH)/2,
-			 SPLIT_LINE_POS(canvas),
-			 BAR_IMG_WIDTH,
-			 BAR_IMG_HEIGHT,
-			 BAR_IMG_BYTES_PER_PIXEL,
-			 BAR_IMG_ROWSTRIDE,
-			 BAR_IMG_RLE_PIXEL_DATA);
-
-  psplash_draw_progress(canvas, 0);
+  bar = psplash_image_new(canvas,
+			  BAR_IMG_WIDTH,
+			  BAR_IMG_HEIGHT,
+			  BAR_IMG_BYTES_PER_PIXEL,
+			  BAR_IMG_ROWSTRIDE,
+			  BAR_IMG_RLE_PIXEL_DATA);
 #endif
 
-#ifdef PSPLASH_STARTUP_MSG
-  psplash_draw_msg(canvas, PSPLASH_STARTUP_MSG);
-#endif
+  /* Displays of different sizes each have a canvas of their own. They are
+   * drawn one after the other: text goes through the shared glyph cache,
+   * which has no locking, and filling the screens is bound by memory
+   * bandwidth, which a second thread does not add to. */
+  for (c = canvas; c; c = c->next)
+    psplash_draw_scene(c, logo, bar);
 
   /* Scene set so let's flip the buffers. */
   /* The first time we also synchronize the buffers so we can build on an
@@ -380,21 +926,66 @@ main (int argc, char** argv)
    * text and progress bar change which overwrite the specific areas with every
    * update.
    */
-  canvas->flip(canvas, 1);
+  for (c = canvas; c; c = c->next)
+    c->flip(c, 1);
+
+  /* Updates only change the message and progress bar, so have them drawn
+   * on a plane of their own if the backend can, leaving the scene alone */
+  if (canvas->new_layer && !canvas->next)
+    {
+      int top = SPLIT_LINE_POS(canvas) - PSPLASH_LAYER_MSG_LINES * FONT_DEF.height;
+      int bottom = SPLIT_LINE_POS(canvas);
+#ifdef PSPLASH_SHOW_PROGRESS_BAR
+      bottom += BAR_IMG_HEIGHT;
+#endif
+      layer = canvas->new_layer(canvas, 0, top, canvas->width, bottom - top);
+      if (layer)
+        canvas = layer;
+    }
 
-  psplash_main(canvas, pipe_fd, 0);
+  /* Only a QUIT leaves the splash on screen, -k applies to any of them */
+  switch (psplash_main(canvas, pipe_fd, listen_fd, shm, signal_fd, 0))
+    {
+    case PSPLASH_EXIT_KEEP:
+      keep = TRUE;
+      break;
+    case PSPLASH_EXIT_QUIT:
+      break;
+    default:
+      keep = FALSE;
+      break;
+    }
+
+  psplash_image_free(logo);
+  psplash_image_free(bar);
 
   if (fb)
     psplash_fb_destroy(fb);
 #ifdef ENABLE_DRM
   if (drm)
-    psplash_drm_destroy(drm);
+    {
+      /* Leave the last frame scanned out for the next DRM master */
+      if (keep)
+        psplash_drm_keep(drm);
+      psplash_drm_destroy(drm);
+    }
 #endif
 
  error:
+  close(dummy_fd);
+  close(signal_fd);
   unlink(PSPLASH_FIFO);
+  if (listen_fd >= 0)
+    {
+      close(listen_fd);
+      unlink(PSPLASH_SOCKET);
+    }
+  if (shm)
+    psplash_shm_destroy(shm);
 
-  if (!disable_console_switch)
+  /* Staying in graphics mode keeps the console from drawing over the
+   * splash before the next user of the display takes over */
+  if (!disable_console_switch && !(keep && ret == 0))
     psplash_console_reset ();
 
   return ret;
@@ -26,11 +26,16 @@
 #if defined(__i386__) || defined(__alpha__)
 #include <sys/io.h>
 #endif
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <stdbool.h>
 
@@ -46,10 +51,22 @@ typedef uint16_t uint16;
 #endif
 
 #define PSPLASH_FIFO "psplash_fifo"
+#define PSPLASH_SOCKET "psplash.sock"
+
+/* Longest command message read at once */
+#define PSPLASH_CMD_MAX 2048
 
 #define CLAMP(x, low, high) \
    (((x) > (high)) ? (high) : (((x) < (low)) ? (low) : (x)))
 
+#ifndef MIN
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#endif
+
+#ifndef MAX
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+#endif
+
 #define DEBUG 0
 
 #if DEBUG